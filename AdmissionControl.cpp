@@ -0,0 +1,108 @@
+#include "AdmissionControl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utils.h"
+
+namespace direct_output_proxy {
+	AdmissionTicket::~AdmissionTicket() {
+		if (in_flight_ != nullptr) in_flight_->fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	AdmissionControl::AdmissionControl(const AdmissionLimits limits) : limits_(limits) {
+	}
+
+	AdmissionControl::Bucket& AdmissionControl::Refill(Buckets& buckets, const std::string& key, const double rate,
+		const double burst, const std::chrono::steady_clock::time_point now) {
+		auto it = buckets.find(key);
+		if (it == buckets.end()) {
+			if (buckets.size() >= kMaxClientBuckets) {
+				// The bucket idle the longest is the closest to full, so forgetting it gives away the least.
+				auto oldest = std::min_element(buckets.begin(), buckets.end(), [](const auto& a, const auto& b) {
+					return a.second.refilled < b.second.refilled;
+				});
+				buckets.erase(oldest);
+			}
+			it = buckets.emplace(key, Bucket{ .tokens = burst, .refilled = now }).first;
+		}
+
+		Bucket& bucket = it->second;
+		const std::chrono::duration<double> elapsed = now - bucket.refilled;
+		bucket.tokens = std::min(burst, bucket.tokens + elapsed.count() * rate);
+		bucket.refilled = now;
+		return bucket;
+	}
+
+	std::optional<std::chrono::seconds> AdmissionControl::TakeToken(const std::string& address, const std::string& client) {
+		const auto now = std::chrono::steady_clock::now();
+		std::lock_guard lock(mutex_);
+
+		std::vector<std::pair<Bucket*, double>> buckets;
+		if (limits_.client_rate > 0) {
+			const std::string key = client.empty() ? address : address + "/" + client;
+			buckets.emplace_back(&Refill(client_buckets_, key, limits_.client_rate, limits_.client_burst, now), limits_.client_rate);
+		}
+		if (limits_.address_rate > 0) {
+			buckets.emplace_back(&Refill(address_buckets_, address, limits_.address_rate, limits_.address_burst, now),
+				limits_.address_rate);
+		}
+
+		std::optional<std::chrono::seconds> wait;
+		for (const auto& [bucket, rate] : buckets) {
+			if (bucket->tokens >= 1) continue;
+			const auto bucket_wait = std::chrono::seconds(static_cast<int64_t>(std::ceil((1 - bucket->tokens) / rate)));
+			wait = std::max(wait.value_or(bucket_wait), bucket_wait);
+		}
+		if (wait.has_value()) return wait;
+		for (const auto& [bucket, rate] : buckets) bucket->tokens -= 1;
+		return std::nullopt;
+	}
+
+	HRESULT AdmissionControl::Admit(const std::string& address, const std::string& client,
+		const std::optional<DeviceHandle> device, const size_t queued, AdmissionTicket* ticket,
+		std::chrono::seconds* retry_after) {
+		if (device.has_value() && limits_.device_in_flight > 0) {
+			std::atomic<uint32_t>& in_flight = in_flight_[device->slot];
+			// Queued operations count too, as writes from shared memory and UDP don't hold tickets.
+			bool busy = queued >= limits_.device_in_flight;
+			if (!busy && in_flight.fetch_add(1, std::memory_order_relaxed) >= limits_.device_in_flight) {
+				in_flight.fetch_sub(1, std::memory_order_relaxed);
+				busy = true;
+			}
+			if (busy) {
+				device_limited_.fetch_add(1, std::memory_order_relaxed);
+				// The device is busy with other requests, which take milliseconds. A second is the least Retry-After says.
+				*retry_after = std::chrono::seconds(1);
+				return -ERROR_BUSY;
+			}
+			ticket->in_flight_ = &in_flight;
+		}
+
+		if (limits_.client_rate > 0 || limits_.address_rate > 0) {
+			std::optional<std::chrono::seconds> wait = TakeToken(address, client);
+			if (wait.has_value()) {
+				rate_limited_.fetch_add(1, std::memory_order_relaxed);
+				*retry_after = std::max(wait.value(), std::chrono::seconds(1));
+				return -ERROR_BUSY;
+			}
+		}
+
+		admitted_.fetch_add(1, std::memory_order_relaxed);
+		return S_OK;
+	}
+
+	std::string AdmissionControl::GetInfo() {
+		std::string info = std::format("admission: {}/s per client, burst {}, {}/s per address, burst {}, {} writes in flight per device",
+			limits_.client_rate, limits_.client_burst, limits_.address_rate, limits_.address_burst, limits_.device_in_flight);
+		info += std::format("\nadmitted {}, rate limited {}, device busy {}", admitted_.load(std::memory_order_relaxed),
+			rate_limited_.load(std::memory_order_relaxed), device_limited_.load(std::memory_order_relaxed));
+		std::lock_guard lock(mutex_);
+		info += std::format(", clients {}, addresses {}", client_buckets_.size(), address_buckets_.size());
+		return info;
+	}
+}
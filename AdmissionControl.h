@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include <Windows.h>
+#include "DeviceRegistry.h"
+#include "types.h"
+
+namespace direct_output_proxy {
+	// Clients, and addresses, whose buckets are kept. Beyond this, the least recently used bucket is forgotten.
+	constexpr size_t kMaxClientBuckets = 1024;
+
+	// Limits of write requests. 0 turns a limit off.
+	struct AdmissionLimits {
+		// Requests per second a client can make on average.
+		double client_rate = 50;
+		// Requests a client can make at once after being idle. At least 1 if client_rate is set.
+		double client_burst = 100;
+		// The same for all clients of an address together, so naming more clients doesn't get an address more.
+		double address_rate = 200;
+		double address_burst = 400;
+		// Write requests handled, or queued on its executor, at a time for each device.
+		uint32_t device_in_flight = 8;
+	};
+
+	// Holds a write slot of a device until destroyed.
+	class AdmissionTicket {
+	public:
+		AdmissionTicket() = default;
+		AdmissionTicket(const AdmissionTicket&) = delete;
+		AdmissionTicket& operator=(const AdmissionTicket&) = delete;
+		~AdmissionTicket();
+	private:
+		friend class AdmissionControl;
+
+		std::atomic<uint32_t>* in_flight_ = nullptr;
+	};
+
+	// Decides whether a write request is handled now, or the client is told to retry later, so a client flooding
+	// the proxy can't make the others wait. Every client, and every address, has a token bucket refilled at its
+	// rate. Every device admits up to device_in_flight writes at a time, and none while as many operations are
+	// queued ahead of them on its executor, e.g. from shared memory or UDP, as further ones would only wait there.
+	// Thread-safe.
+	class AdmissionControl {
+	public:
+		explicit AdmissionControl(AdmissionLimits limits);
+
+		// Admits a write request from `address` to `device`, or to no device, e.g. an image upload. `client` is
+		// the ID the client named itself with, or empty, then the address is the client. `queued` is the
+		// device's GetQueueDepth() for the request's lane. While `ticket` lives the request counts against the
+		// device. Requests still running for a removed device count against the next device in its registry
+		// slot, until they end. Fails with -ERROR_BUSY if a limit is reached, and stores when to retry in
+		// `retry_after`.
+		HRESULT Admit(const std::string& address, const std::string& client, std::optional<DeviceHandle> device,
+			size_t queued, AdmissionTicket* ticket, std::chrono::seconds* retry_after);
+
+		std::string GetInfo();
+	private:
+		struct Bucket {
+			double tokens = 0;
+			std::chrono::steady_clock::time_point refilled;
+		};
+
+		using Buckets = std::map<std::string, Bucket>;
+
+		// Returns the bucket of `key`, refilled at `rate` up to `burst`, making room for it if needed. Requires
+		// mutex_.
+		static Bucket& Refill(Buckets& buckets, const std::string& key, double rate, double burst,
+			std::chrono::steady_clock::time_point now);
+
+		// Takes a token from the buckets of the address and the client, or none if either is empty. Returns how
+		// long until both have one then.
+		std::optional<std::chrono::seconds> TakeToken(const std::string& address, const std::string& client);
+
+		const AdmissionLimits limits_;
+
+		std::mutex mutex_;
+		// By address and client ID, or address alone for clients without one.
+		Buckets client_buckets_;
+		Buckets address_buckets_;
+
+		// By registry slot, so two devices of a type are limited separately.
+		std::array<std::atomic<uint32_t>, kMaxDevices> in_flight_ = {};
+
+		std::atomic<uint64_t> admitted_ = 0;
+		std::atomic<uint64_t> rate_limited_ = 0;
+		std::atomic<uint64_t> device_limited_ = 0;
+	};
+}
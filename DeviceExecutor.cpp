@@ -0,0 +1,326 @@
+#include "DeviceExecutor.h"
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+
+#include <Windows.h>
+#include "Tracer.h"
+#include "utils.h"
+
+namespace direct_output_proxy {
+	namespace {
+		thread_local int sdk_callback_depth = 0;
+		thread_local WriteLane current_lane = WriteLane::kNormal;
+	}
+
+	SdkCallbackScope::SdkCallbackScope() {
+		++sdk_callback_depth;
+	}
+
+	SdkCallbackScope::~SdkCallbackScope() {
+		--sdk_callback_depth;
+	}
+
+	bool SdkCallbackScope::Active() {
+		return sdk_callback_depth > 0;
+	}
+
+	WriteLaneScope::WriteLaneScope(const WriteLane lane) : previous_(current_lane) {
+		current_lane = lane;
+	}
+
+	WriteLaneScope::~WriteLaneScope() {
+		current_lane = previous_;
+	}
+
+	WriteLane WriteLaneScope::Current() {
+		return current_lane;
+	}
+
+	DeviceExecutor::DeviceExecutor(std::function<HRESULT()> recover) : state_(std::make_shared<State>()) {
+		state_->recover = std::move(recover);
+		worker_ = std::thread(&DeviceExecutor::WorkerLoop, state_);
+		worker_id_ = worker_.get_id();
+	}
+
+	DeviceExecutor::~DeviceExecutor() {
+		Stop();
+	}
+
+	bool DeviceExecutor::Stop() {
+		if (!worker_.joinable()) return !abandoned_;
+		std::unique_lock lock(state_->mutex);
+		state_->stop = true;
+		state_->work_cv.notify_all();
+		const bool done = state_->done_cv.wait_for(lock, kWorkerStopDeadline, [this]() { return state_->worker_done; });
+		lock.unlock();
+		if (done) {
+			worker_.join();
+			return true;
+		}
+		// It owns what it uses, and ends once the library returns.
+		Debug() << "device worker stuck in a call, leaving it behind" << std::endl;
+		worker_.detach();
+		abandoned_ = true;
+		return false;
+	}
+
+	HRESULT DeviceExecutor::Run(std::function<HRESULT()> call) {
+		return Execute(std::move(call), /*record=*/true);
+	}
+
+	HRESULT DeviceExecutor::Submit(std::function<HRESULT()> task) {
+		return Execute(std::move(task), /*record=*/false);
+	}
+
+	void DeviceExecutor::Post(const WriteLane lane, std::function<void()> task) {
+		auto pending = std::make_shared<Call>();
+		pending->fn = [task = std::move(task)]() {
+			task();
+			return S_OK;
+		};
+		pending->posted = true;
+		pending->queued = std::chrono::steady_clock::now();
+
+		std::lock_guard lock(state_->mutex);
+		if (state_->stop) return;
+		state_->QueueCall(lane, pending);
+		state_->work_cv.notify_all();
+	}
+
+	HRESULT DeviceExecutor::Execute(std::function<HRESULT()> call, const bool record) {
+		if (std::this_thread::get_id() == worker_id_ || SdkCallbackScope::Active()) {
+			// A task's own result only sums up its calls, which were recorded already.
+			if (!record) return call();
+			RETURN_IF_ERROR(CheckAvailable());
+			HRESULT result = call();
+			std::lock_guard lock(state_->mutex);
+			state_->RecordResult(result);
+			return result;
+		}
+
+		const uint64_t request = GetTraceRequest();
+		if (request != 0) {
+			const int64_t queued = TraceNow();
+			call = [call = std::move(call), request, queued]() {
+				TraceRequestScope scope(request);
+				RecordTraceSpan("sdk queue", queued, TraceNow());
+				return call();
+			};
+		}
+
+		auto pending = std::make_shared<Call>();
+		pending->fn = std::move(call);
+		pending->queued = std::chrono::steady_clock::now();
+
+		std::unique_lock lock(state_->mutex);
+		// Checked when queueing, so nothing is queued once the breaker opened.
+		if (state_->stop || state_->breaker != BreakerState::kClosed) return -ERROR_SERVICE_NOT_ACTIVE;
+		state_->QueueCall(WriteLaneScope::Current(), pending);
+		state_->work_cv.notify_all();
+
+		while (!pending->result.has_value()) {
+			// A queued call waits as long as the calls before it keep within their deadline.
+			std::optional<std::chrono::steady_clock::time_point> deadline;
+			if (pending->started.has_value()) {
+				deadline = pending->started.value() + kSdkCallDeadline;
+			} else if (state_->running_since.has_value()) {
+				deadline = state_->running_since.value() + kSdkCallDeadline;
+			}
+			if (!deadline.has_value()) {
+				state_->done_cv.wait(lock);
+			} else if (std::chrono::steady_clock::now() >= deadline.value()) {
+				// This call, or the one the worker is stuck in, is past its deadline.
+				state_->RemoveQueuedCall(pending);
+				state_->RecordResult(-ERROR_TIMEOUT);
+				return -ERROR_TIMEOUT;
+			} else {
+				state_->done_cv.wait_until(lock, deadline.value());
+			}
+		}
+		const HRESULT result = pending->result.value();
+		if (record) state_->RecordResult(result);
+		return result;
+	}
+
+	HRESULT DeviceExecutor::CheckAvailable() {
+		std::lock_guard lock(state_->mutex);
+		return !state_->stop && state_->breaker == BreakerState::kClosed ? S_OK : -ERROR_SERVICE_NOT_ACTIVE;
+	}
+
+	size_t DeviceExecutor::GetQueueDepth(const WriteLane lane) {
+		size_t depth = 0;
+		for (size_t i = 0; i <= static_cast<size_t>(lane); ++i) depth += state_->lane_sizes[i].load(std::memory_order_relaxed);
+		return depth;
+	}
+
+	bool DeviceExecutor::IsDeviceFailure(const HRESULT result) {
+		switch (result) {
+		case -ERROR_TIMEOUT:
+		case E_HANDLE:
+		case E_FAIL:
+		case E_UNEXPECTED:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	void DeviceExecutor::State::RecordResult(const HRESULT result) {
+		// Calls failed by the breaker itself say nothing about the device.
+		if (result == -ERROR_SERVICE_NOT_ACTIVE) return;
+		// Any other answer, including rejecting the call, means the device responds.
+		if (!IsDeviceFailure(result)) {
+			consecutive_failures = 0;
+			return;
+		}
+
+		++failures;
+		if (result == -ERROR_TIMEOUT) ++timeouts;
+		if (++consecutive_failures < kBreakerFailureThreshold || breaker != BreakerState::kClosed) return;
+
+		Debug() << "device breaker open after " << consecutive_failures << " failures, last: " << ResultToString(result) << std::endl;
+		breaker = BreakerState::kOpen;
+		next_probe = std::chrono::steady_clock::now() + kBreakerProbeInterval;
+		++trips;
+		work_cv.notify_all();
+	}
+
+	void DeviceExecutor::State::QueueCall(const WriteLane lane, std::shared_ptr<Call> call) {
+		lanes[static_cast<size_t>(lane)].push_back(std::move(call));
+		lane_sizes[static_cast<size_t>(lane)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void DeviceExecutor::State::FailQueuedCalls(const bool keep_posted) {
+		for (size_t lane = 0; lane < kWriteLanes; ++lane) {
+			const size_t failed = std::erase_if(lanes[lane], [keep_posted](const std::shared_ptr<Call>& call) {
+				if (keep_posted && call->posted) return false;
+				call->result = -ERROR_SERVICE_NOT_ACTIVE;
+				return true;
+			});
+			lane_sizes[lane].fetch_sub(failed, std::memory_order_relaxed);
+		}
+		done_cv.notify_all();
+	}
+
+	bool DeviceExecutor::State::HasQueuedCalls() {
+		for (const std::deque<std::shared_ptr<Call>>& lane : lanes) {
+			if (!lane.empty()) return true;
+		}
+		return false;
+	}
+
+	void DeviceExecutor::State::RemoveQueuedCall(const std::shared_ptr<Call>& call) {
+		for (size_t lane = 0; lane < kWriteLanes; ++lane) {
+			lane_sizes[lane].fetch_sub(std::erase(lanes[lane], call), std::memory_order_relaxed);
+		}
+	}
+
+	std::shared_ptr<DeviceExecutor::Call> DeviceExecutor::State::PopCall() {
+		const auto now = std::chrono::steady_clock::now();
+		size_t next = kWriteLanes;
+		bool was_aged = false;
+		for (size_t lane = 0; lane < kWriteLanes; ++lane) {
+			if (lanes[lane].empty()) continue;
+			if (next == kWriteLanes) {
+				next = lane;
+				continue;
+			}
+			const auto queued = lanes[lane].front()->queued;
+			if (now - queued >= kLaneAgingLimit && queued < lanes[next].front()->queued) {
+				next = lane;
+				was_aged = true;
+			}
+		}
+
+		std::shared_ptr<Call> call = std::move(lanes[next].front());
+		lanes[next].pop_front();
+		lane_sizes[next].fetch_sub(1, std::memory_order_relaxed);
+		++lane_calls[next];
+		if (was_aged) ++aged;
+		const int64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(now - call->queued).count();
+		lane_max_wait_us[next] = std::max(lane_max_wait_us[next], wait_us);
+		return call;
+	}
+
+	void DeviceExecutor::RunNextCall(State& state, std::unique_lock<std::mutex>& lock) {
+		std::shared_ptr<Call> call = state.PopCall();
+		call->started = std::chrono::steady_clock::now();
+		state.running_since = call->started;
+		state.done_cv.notify_all();
+		lock.unlock();
+		const HRESULT result = call->fn();
+		lock.lock();
+		call->result = result;
+		state.running_since.reset();
+		state.done_cv.notify_all();
+	}
+
+	void DeviceExecutor::WorkerLoop(std::shared_ptr<State> state) {
+		std::unique_lock lock(state->mutex);
+		while (!state->stop) {
+			if (state->breaker == BreakerState::kOpen) {
+				// Calls queued before the breaker opened are not sent to a device which is not responding. Posted
+				// tasks still run; their calls fail.
+				state->FailQueuedCalls(/*keep_posted=*/true);
+				if (std::chrono::steady_clock::now() < state->next_probe) {
+					state->work_cv.wait_until(lock, state->next_probe, [&state]() { return state->stop || state->HasQueuedCalls(); });
+					if (state->stop) break;
+					if (state->HasQueuedCalls()) RunNextCall(*state, lock);
+					continue;
+				}
+
+				state->breaker = BreakerState::kHalfOpen;
+				lock.unlock();
+				HRESULT result = state->recover();
+				lock.lock();
+				if (SUCCEEDED(result)) {
+					Debug() << "device recovered, breaker closed" << std::endl;
+					state->breaker = BreakerState::kClosed;
+					state->consecutive_failures = 0;
+				} else {
+					state->breaker = BreakerState::kOpen;
+					state->next_probe = std::chrono::steady_clock::now() + kBreakerProbeInterval;
+				}
+				continue;
+			}
+
+			state->work_cv.wait(lock, [&state]() {
+				return state->stop || state->HasQueuedCalls() || state->breaker == BreakerState::kOpen;
+			});
+			if (state->stop || state->breaker == BreakerState::kOpen || !state->HasQueuedCalls()) continue;
+			RunNextCall(*state, lock);
+		}
+		state->FailQueuedCalls(/*keep_posted=*/false);
+		state->worker_done = true;
+		state->done_cv.notify_all();
+	}
+
+	const wchar_t* DeviceExecutor::BreakerStateToString(const BreakerState state) {
+		switch (state) {
+		case BreakerState::kClosed:
+			return L"closed";
+		case BreakerState::kOpen:
+			return L"open";
+		case BreakerState::kHalfOpen:
+		default:
+			return L"probing";
+		}
+	}
+
+	std::wstring DeviceExecutor::GetInfo() {
+		std::lock_guard lock(state_->mutex);
+		std::wstring info = std::wstring(L"sdk breaker: ") + BreakerStateToString(state_->breaker) +
+			L", failures: " + std::to_wstring(state_->failures) + L", timeouts: " + std::to_wstring(state_->timeouts) +
+			L", trips: " + std::to_wstring(state_->trips);
+		const wchar_t* lane_names[kWriteLanes] = { L"interactive", L"normal", L"bulk" };
+		info += L"\nsdk lanes:";
+		for (size_t lane = 0; lane < kWriteLanes; ++lane) {
+			info += std::wstring(L" ") + lane_names[lane] + L" " + std::to_wstring(state_->lane_calls[lane]) + L" calls, max wait " +
+				std::to_wstring(state_->lane_max_wait_us[lane]) + L"us;";
+		}
+		info += L" aged: " + std::to_wstring(state_->aged);
+		return info;
+	}
+}
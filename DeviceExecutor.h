@@ -0,0 +1,187 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include <Windows.h>
+#include "types.h"
+
+namespace direct_output_proxy {
+	// How long a caller waits for an SDK call once it started running before failing it with -ERROR_TIMEOUT.
+	constexpr std::chrono::milliseconds kSdkCallDeadline(500);
+	// How long stopping an executor waits for the call its worker is running, before leaving it to finish alone.
+	constexpr std::chrono::seconds kWorkerStopDeadline(1);
+	// Consecutive timed out calls and device errors which open the circuit breaker.
+	constexpr int kBreakerFailureThreshold = 5;
+	// How often a device is probed while its breaker is open.
+	constexpr std::chrono::seconds kBreakerProbeInterval(2);
+	// How long a queued call waits behind calls of higher lanes at most. Well below kSdkCallDeadline, so a busy
+	// higher lane delays lower lanes but doesn't make their calls time out.
+	constexpr std::chrono::milliseconds kLaneAgingLimit(100);
+	constexpr size_t kWriteLanes = 3;
+
+	// Marks the current thread as running an SDK callback while in scope. SDK calls made from a callback run
+	// inline, as the library may hold locks the worker would wait for.
+	class SdkCallbackScope {
+	public:
+		SdkCallbackScope();
+		~SdkCallbackScope();
+
+		static bool Active();
+	};
+
+	// Makes the SDK calls of the current thread use `lane` while in scope. Calls outside any scope use kNormal.
+	class WriteLaneScope {
+	public:
+		explicit WriteLaneScope(WriteLane lane);
+		~WriteLaneScope();
+
+		static WriteLane Current();
+	private:
+		WriteLane previous_;
+	};
+
+	// Runs the SDK calls of one device on a worker thread, so a stalled library blocks the worker rather than
+	// the request threads. A caller gives up kSdkCallDeadline after its call started, or once the call running
+	// before it is past its deadline, as the worker is stalled then.
+	// Besides single calls, the worker runs device tasks: whole device operations, whose SDK calls then run
+	// inline. Tasks run one at a time, so the worker is the only thread changing the device, and callers don't
+	// hold any device lock while they wait.
+	// A circuit breaker opens after kBreakerFailureThreshold consecutive timeouts or device errors (see
+	// IsDeviceFailure()). While it's open calls fail with -ERROR_SERVICE_NOT_ACTIVE without reaching the library,
+	// and `recover` is run on the worker every kBreakerProbeInterval. It should probe the device and restore its
+	// state; the breaker closes once it succeeds.
+	// Queued calls and tasks run by WriteLane, highest first, except that one which waited kLaneAgingLimit runs
+	// before those of higher lanes queued after it.
+	// The worker only shares state with the executor through a shared_ptr, so a worker stuck in the library can
+	// be abandoned by Stop().
+	class DeviceExecutor {
+	public:
+		explicit DeviceExecutor(std::function<HRESULT()> recover);
+		DeviceExecutor(const DeviceExecutor&) = delete;
+		DeviceExecutor& operator=(const DeviceExecutor&) = delete;
+		~DeviceExecutor();
+
+		// Runs the call in the lane of the current WriteLaneScope and returns its result. The call may still run
+		// after a timeout, so it must not reference the caller's stack or the device. Calls made from the worker
+		// itself, i.e. by tasks, run inline.
+		HRESULT Run(std::function<HRESULT()> call);
+
+		// Runs a device task like Run() runs a call, and returns its result. Only the task's SDK calls, made with
+		// Run(), count for the breaker, and its timeout. The task may still run after a timeout, so it must not
+		// reference the caller's stack; it may reference the device, which outlives the worker (see Stop()).
+		// Tasks submitted by tasks run inline.
+		HRESULT Submit(std::function<HRESULT()> task);
+
+		// Queues a task in `lane` without waiting for it. Posted tasks run while the breaker is open too, with
+		// their SDK calls failing, as they pass on device events which the device state must see. Dropped once
+		// stopped.
+		void Post(WriteLane lane, std::function<void()> task);
+
+		// Fails with -ERROR_SERVICE_NOT_ACTIVE unless the breaker is closed.
+		HRESULT CheckAvailable();
+
+		// Returns how many calls and tasks are queued in `lane` and the lanes above it, i.e. ahead of a call
+		// queued in `lane` now, apart from aging. Doesn't lock.
+		size_t GetQueueDepth(WriteLane lane);
+
+		// Stops the worker, failing the queued calls. Waits kWorkerStopDeadline for the call it's running, then
+		// detaches it and returns false: the call, or task, may still run. `recover` is not run once this returns.
+		bool Stop();
+
+		std::wstring GetInfo();
+
+		// Whether a failed call says the device isn't working, rather than that the call was wrong.
+		static bool IsDeviceFailure(HRESULT result);
+	private:
+		enum class BreakerState {
+			kClosed,
+			kOpen,
+			// `recover` is running.
+			kHalfOpen,
+		};
+
+		struct Call {
+			std::function<HRESULT()> fn;
+			// Nobody waits for it; see Post().
+			bool posted = false;
+			std::chrono::steady_clock::time_point queued;
+			std::optional<std::chrono::steady_clock::time_point> started;
+			std::optional<HRESULT> result;
+		};
+
+		// Everything the worker uses, owned by both the executor and the worker.
+		struct State {
+			std::function<HRESULT()> recover;
+
+			std::mutex mutex;
+			// Signals the worker: queued calls, stopping, the breaker opening.
+			std::condition_variable work_cv;
+			// Signals callers: calls starting and finishing, and the worker ending.
+			std::condition_variable done_cv;
+			std::array<std::deque<std::shared_ptr<Call>>, kWriteLanes> lanes;
+			// The size of each lane, for GetQueueDepth().
+			std::array<std::atomic<size_t>, kWriteLanes> lane_sizes = {};
+			// Since when the worker runs the call it's running, if any.
+			std::optional<std::chrono::steady_clock::time_point> running_since;
+			bool stop = false;
+			bool worker_done = false;
+
+			BreakerState breaker = BreakerState::kClosed;
+			int consecutive_failures = 0;
+			std::chrono::steady_clock::time_point next_probe;
+			uint64_t failures = 0;
+			uint64_t timeouts = 0;
+			uint64_t trips = 0;
+			std::array<uint64_t, kWriteLanes> lane_calls = {};
+			std::array<int64_t, kWriteLanes> lane_max_wait_us = {};
+			// Calls which ran before higher lanes as they waited kLaneAgingLimit.
+			uint64_t aged = 0;
+
+			// Updates the breaker with the result of a call. Requires `mutex`.
+			void RecordResult(HRESULT result);
+
+			// Requires `mutex`.
+			void QueueCall(WriteLane lane, std::shared_ptr<Call> call);
+
+			// Fails the queued calls, and drops the posted ones unless `keep_posted`. Requires `mutex`.
+			void FailQueuedCalls(bool keep_posted);
+
+			// Requires `mutex`.
+			bool HasQueuedCalls();
+
+			// Takes the next call to run. Requires `mutex` and a queued call.
+			std::shared_ptr<Call> PopCall();
+
+			// Removes the call if it's still queued. Requires `mutex`.
+			void RemoveQueuedCall(const std::shared_ptr<Call>& call);
+		};
+
+		// Runs or queues the call, recording its result for the breaker if `record`. A timeout is always recorded.
+		HRESULT Execute(std::function<HRESULT()> call, bool record);
+
+		static const wchar_t* BreakerStateToString(BreakerState state);
+
+		// Runs the call PopCall() picks. Requires `lock` on the state's mutex, which is released meanwhile.
+		static void RunNextCall(State& state, std::unique_lock<std::mutex>& lock);
+
+		static void WorkerLoop(std::shared_ptr<State> state);
+
+		std::shared_ptr<State> state_;
+		std::thread worker_;
+		std::thread::id worker_id_;
+		// Stop() left the worker behind.
+		bool abandoned_ = false;
+	};
+}
@@ -0,0 +1,115 @@
+#include "DeviceRegistry.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "utils.h"
+
+namespace direct_output_proxy {
+	ReadGuard DeviceRegistry::EnterRead() {
+		while (true) {
+			const uint64_t epoch = epoch_.load();
+			std::atomic<int64_t>& readers = readers_[epoch & 1].count;
+			readers.fetch_add(1);
+			// If a writer moved on meanwhile it may not have seen this reader, so count in the new epoch instead.
+			if (epoch_.load() == epoch) return ReadGuard(&readers);
+			readers.fetch_sub(1);
+		}
+	}
+
+	void DeviceRegistry::TryAdvanceEpoch() {
+		const uint64_t epoch = epoch_.load();
+		// The next epoch shares its count with the previous one.
+		if (readers_[(epoch + 1) & 1].count.load() == 0) epoch_.store(epoch + 1);
+	}
+
+	DirectOutputDevice* DeviceRegistry::ReadSlot(const uint32_t slot, const uint32_t generation) {
+		const Slot& entry = slots_[slot];
+		if (entry.generation.load() != generation) return nullptr;
+		DirectOutputDevice* device = entry.device.load();
+		// The slot may have been emptied and reused after the generation was read.
+		if (entry.generation.load() != generation) return nullptr;
+		return device;
+	}
+
+	std::optional<DeviceHandle> DeviceRegistry::Add(void* sdk_handle, std::unique_ptr<DirectOutputDevice> device) {
+		std::lock_guard lock(writer_mutex_);
+		for (uint32_t slot = 0; slot < slots_.size(); ++slot) {
+			Slot& entry = slots_[slot];
+			if (entry.owner) continue;
+			const DeviceHandle handle{ .slot = slot, .generation = entry.generation.load() };
+			entry.sdk_handle = sdk_handle;
+			entry.owner = std::move(device);
+			entry.owner->SetId(handle.id());
+			entry.device.store(entry.owner.get());
+			return handle;
+		}
+		Debug() << "device: " << sdk_handle << " ignored, " << kMaxDevices << " devices attached already" << std::endl;
+		return std::nullopt;
+	}
+
+	bool DeviceRegistry::Remove(void* sdk_handle) {
+		std::lock_guard lock(writer_mutex_);
+		for (Slot& entry : slots_) {
+			if (!entry.owner || entry.sdk_handle != sdk_handle) continue;
+			entry.device.store(nullptr);
+			entry.generation.fetch_add(1);
+			entry.sdk_handle = nullptr;
+			retired_.push_back({ .device = std::move(entry.owner), .epoch = epoch_.load() });
+			TryAdvanceEpoch();
+			return true;
+		}
+		return false;
+	}
+
+	size_t DeviceRegistry::Reclaim() {
+		std::vector<Retired> reclaimed;
+		size_t waiting = 0;
+		{
+			std::lock_guard lock(writer_mutex_);
+			if (retired_.empty()) return 0;
+			TryAdvanceEpoch();
+			TryAdvanceEpoch();
+			const uint64_t epoch = epoch_.load();
+			auto unused = std::partition(retired_.begin(), retired_.end(), [epoch](const Retired& entry) { return epoch < entry.epoch + 2; });
+			reclaimed.assign(std::make_move_iterator(unused), std::make_move_iterator(retired_.end()));
+			retired_.erase(unused, retired_.end());
+			waiting = retired_.size();
+		}
+		for (Retired& entry : reclaimed) {
+			if (entry.device->StopExecutor()) continue;
+			// A task stuck in the library still uses the device, so it's left to it.
+			Debug() << "device: " << entry.device->GetHandle() << " not destroyed, its worker is stuck" << std::endl;
+			entry.device.release();
+		}
+		return waiting;
+	}
+
+	DeviceRef DeviceRegistry::Get(const DeviceHandle handle) {
+		if (handle.slot >= slots_.size()) return {};
+		ReadGuard guard = EnterRead();
+		DirectOutputDevice* device = ReadSlot(handle.slot, handle.generation);
+		if (device == nullptr) return {};
+		return DeviceRef(std::move(guard), device, handle);
+	}
+
+	DeviceRef DeviceRegistry::Find(const std::function<bool(DirectOutputDevice&)>& predicate) {
+		ReadGuard guard = EnterRead();
+		for (uint32_t slot = 0; slot < slots_.size(); ++slot) {
+			const uint32_t generation = slots_[slot].generation.load();
+			DirectOutputDevice* device = ReadSlot(slot, generation);
+			if (device != nullptr && predicate(*device)) {
+				return DeviceRef(std::move(guard), device, { .slot = slot, .generation = generation });
+			}
+		}
+		return {};
+	}
+
+	void DeviceRegistry::ForEach(const std::function<void(DirectOutputDevice&)>& callback) {
+		ReadGuard guard = EnterRead();
+		for (uint32_t slot = 0; slot < slots_.size(); ++slot) {
+			DirectOutputDevice* device = ReadSlot(slot, slots_[slot].generation.load());
+			if (device != nullptr) callback(*device);
+		}
+	}
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "DirectOutputDevice.h"
+
+namespace direct_output_proxy {
+	// Devices which can be attached at the same time.
+	constexpr size_t kMaxDevices = 16;
+
+	// Identifies a device for as long as it's attached. A slot is reused by later devices, but with a new
+	// generation, so a stale handle finds nothing rather than another device.
+	struct DeviceHandle {
+		uint32_t slot = 0;
+		uint32_t generation = 0;
+
+		// The handle as one number, for clients.
+		DeviceId id() const {
+			return static_cast<DeviceId>(generation) << 32 | slot;
+		}
+	};
+
+	// Keeps the devices read while it's held from being destroyed. Does not block anything else, not even removing
+	// them.
+	class ReadGuard {
+	public:
+		ReadGuard() = default;
+		explicit ReadGuard(std::atomic<int64_t>* readers) : readers_(readers) {
+		}
+		ReadGuard(ReadGuard&& other) noexcept : readers_(other.readers_) {
+			other.readers_ = nullptr;
+		}
+		ReadGuard& operator=(ReadGuard&& other) noexcept {
+			if (this != &other) {
+				Release();
+				readers_ = other.readers_;
+				other.readers_ = nullptr;
+			}
+			return *this;
+		}
+		~ReadGuard() {
+			Release();
+		}
+	private:
+		void Release() {
+			if (readers_ != nullptr) readers_->fetch_sub(1);
+			readers_ = nullptr;
+		}
+
+		std::atomic<int64_t>* readers_ = nullptr;
+	};
+
+	// A device which stays alive while the reference is held, even if it's detached meanwhile.
+	// Hold it for the duration of a request, not longer: removed devices are only destroyed once no reference is
+	// left from before they were removed.
+	class DeviceRef {
+	public:
+		DeviceRef() = default;
+		DeviceRef(ReadGuard guard, DirectOutputDevice* device, DeviceHandle handle)
+			: guard_(std::move(guard)), device_(device), handle_(handle) {
+		}
+
+		explicit operator bool() const {
+			return device_ != nullptr;
+		}
+
+		DirectOutputDevice* operator->() const {
+			return device_;
+		}
+
+		DirectOutputDevice& operator*() const {
+			return *device_;
+		}
+
+		DeviceHandle handle() const {
+			return handle_;
+		}
+	private:
+		ReadGuard guard_;
+		DirectOutputDevice* device_ = nullptr;
+		DeviceHandle handle_;
+	};
+
+	// The attached devices, read by request threads and changed by SDK callbacks.
+	// Reads are lock-free: a reader announces itself in the reader count of the current epoch, then reads the
+	// device pointers of the slots. Removing a device clears its slot and retires the device, tagged with the
+	// epoch. The epoch only moves on once the readers of the epoch before it left, so a device retired in epoch e
+	// can't be in use anymore once the epoch is e + 2. Nothing waits for readers: Reclaim() destroys what can be
+	// destroyed, and is run periodically.
+	class DeviceRegistry {
+	public:
+		DeviceRegistry() = default;
+		DeviceRegistry(const DeviceRegistry&) = delete;
+		DeviceRegistry& operator=(const DeviceRegistry&) = delete;
+
+		// Publishes a device, which must be fully initialized, and gives it the ID of its handle. Fails if all
+		// slots are taken.
+		std::optional<DeviceHandle> Add(void* sdk_handle, std::unique_ptr<DirectOutputDevice> device);
+
+		// Unpublishes the device. It's destroyed by Reclaim() once no reader can still use it. Returns false if
+		// there is no such device.
+		bool Remove(void* sdk_handle);
+
+		// Returns an empty reference if the device is gone.
+		DeviceRef Get(DeviceHandle handle);
+
+		// Returns the first device matching the predicate.
+		DeviceRef Find(const std::function<bool(DirectOutputDevice&)>& predicate);
+
+		void ForEach(const std::function<void(DirectOutputDevice&)>& callback);
+
+		// Destroys the removed devices which no reader can still use, outside the lock, as stopping a device
+		// may take a while. A device whose worker is stuck in the library is leaked instead. Returns the number of
+		// devices still waiting.
+		size_t Reclaim();
+	private:
+		struct Slot {
+			std::atomic<DirectOutputDevice*> device = nullptr;
+			// Bumped when the device is removed.
+			std::atomic<uint32_t> generation = 0;
+
+			// Only used by writers.
+			void* sdk_handle = nullptr;
+			std::unique_ptr<DirectOutputDevice> owner;
+		};
+
+		struct alignas(64) ReaderCount {
+			std::atomic<int64_t> count = 0;
+		};
+
+		struct Retired {
+			std::unique_ptr<DirectOutputDevice> device;
+			// The epoch it was unpublished in.
+			uint64_t epoch = 0;
+		};
+
+		ReadGuard EnterRead();
+
+		// Returns the device in the slot if it still has the generation. Requires a ReadGuard.
+		DirectOutputDevice* ReadSlot(uint32_t slot, uint32_t generation);
+
+		// Moves to the next epoch if the readers of the previous one left. Requires writer_mutex_.
+		void TryAdvanceEpoch();
+
+		std::array<Slot, kMaxDevices> slots_;
+		std::mutex writer_mutex_;
+		std::vector<Retired> retired_;
+		std::atomic<uint64_t> epoch_ = 0;
+		std::array<ReaderCount, 2> readers_;
+	};
+}
@@ -0,0 +1,33 @@
+#include "DeviceTraits.h"
+
+#include <algorithm>
+
+namespace direct_output_proxy {
+	namespace {
+		constexpr DeviceCaps kX52ProCaps = MakeDeviceCaps<DeviceTraits<DeviceType::kX52Pro>>();
+		constexpr DeviceCaps kFipCaps = MakeDeviceCaps<DeviceTraits<DeviceType::kFip>>();
+		constexpr DeviceCaps kUnknownCaps = MakeDeviceCaps<DeviceTraits<DeviceType::kUnknown>>();
+	}
+
+	bool DeviceCaps::HasLed(const DWORD index) const {
+		return std::find(leds.begin(), leds.end(), index) != leds.end();
+	}
+
+	const wchar_t* DeviceCaps::GetButtonName(const DWORD button) const {
+		for (const ButtonInfo& info : buttons) {
+			if (info.bit == button) return info.name;
+		}
+		return nullptr;
+	}
+
+	const DeviceCaps& GetDeviceCaps(const DeviceType type) {
+		switch (type) {
+		case DeviceType::kX52Pro:
+			return kX52ProCaps;
+		case DeviceType::kFip:
+			return kFipCaps;
+		default:
+			return kUnknownCaps;
+		}
+	}
+}
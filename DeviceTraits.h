@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <span>
+
+#include <Windows.h>
+#include <DirectOutput.h>
+#include "types.h"
+
+namespace direct_output_proxy {
+	struct ButtonInfo {
+		// The bit in the SDK's button callback.
+		DWORD bit;
+		const wchar_t* name;
+	};
+
+	// What a device type can do, known at compile time. TypedDevice is compiled against these.
+	template <DeviceType type>
+	struct DeviceTraits;
+
+	template <>
+	struct DeviceTraits<DeviceType::kX52Pro> {
+		static constexpr DeviceType kType = DeviceType::kX52Pro;
+		static constexpr DWORD kLines = 3;
+		static constexpr DWORD kLineWidth = 16;
+		static constexpr bool kHasImage = false;
+		static constexpr DWORD kImageWidth = 0;
+		static constexpr DWORD kImageHeight = 0;
+		static constexpr std::array<ButtonInfo, 3> kButtons = { {
+			{ SoftButton_Select, L"Select" },
+			{ SoftButton_Up, L"Up" },
+			{ SoftButton_Down, L"Down" },
+		} };
+		// Fire, Fire A-E, T1-T6, POV 2, Clutch and Throttle, red and green where there are both.
+		static constexpr std::array<DWORD, 20> kLeds = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 };
+	};
+
+	template <>
+	struct DeviceTraits<DeviceType::kFip> {
+		static constexpr DeviceType kType = DeviceType::kFip;
+		static constexpr DWORD kLines = 0;
+		static constexpr DWORD kLineWidth = 0;
+		static constexpr bool kHasImage = true;
+		static constexpr DWORD kImageWidth = 320;
+		static constexpr DWORD kImageHeight = 240;
+		// The FIP reports its soft buttons and rotary knobs with its own bits.
+		static constexpr std::array<ButtonInfo, 10> kButtons = { {
+			{ 0x00000002, L"RightCW" },
+			{ 0x00000004, L"RightCCW" },
+			{ 0x00000008, L"LeftCW" },
+			{ 0x00000010, L"LeftCCW" },
+			{ 0x00000020, L"S1" },
+			{ 0x00000040, L"S2" },
+			{ 0x00000080, L"S3" },
+			{ 0x00000100, L"S4" },
+			{ 0x00000200, L"S5" },
+			{ 0x00000400, L"S6" },
+		} };
+		// The LEDs of S1-S6.
+		static constexpr std::array<DWORD, 6> kLeds = { 1, 2, 3, 4, 5, 6 };
+	};
+
+	template <>
+	struct DeviceTraits<DeviceType::kUnknown> {
+		static constexpr DeviceType kType = DeviceType::kUnknown;
+		static constexpr DWORD kLines = 0;
+		static constexpr DWORD kLineWidth = 0;
+		static constexpr bool kHasImage = false;
+		static constexpr DWORD kImageWidth = 0;
+		static constexpr DWORD kImageHeight = 0;
+		static constexpr std::array<ButtonInfo, 0> kButtons = {};
+		static constexpr std::array<DWORD, 0> kLeds = {};
+	};
+
+	// The traits of a device type, for code which only learns the type at run time, like the HTTP API.
+	struct DeviceCaps {
+		DeviceType type = DeviceType::kUnknown;
+		DWORD lines = 0;
+		DWORD line_width = 0;
+		bool image = false;
+		DWORD image_width = 0;
+		DWORD image_height = 0;
+		std::span<const ButtonInfo> buttons;
+		std::span<const DWORD> leds;
+
+		bool HasLed(DWORD index) const;
+		// Returns nullptr for buttons the device doesn't have.
+		const wchar_t* GetButtonName(DWORD button) const;
+	};
+
+	template <typename Traits>
+	constexpr DeviceCaps MakeDeviceCaps() {
+		return {
+			.type = Traits::kType,
+			.lines = Traits::kLines,
+			.line_width = Traits::kLineWidth,
+			.image = Traits::kHasImage,
+			.image_width = Traits::kImageWidth,
+			.image_height = Traits::kImageHeight,
+			.buttons = Traits::kButtons,
+			.leds = Traits::kLeds,
+		};
+	}
+
+	const DeviceCaps& GetDeviceCaps(DeviceType type);
+}
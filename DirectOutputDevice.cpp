@@ -4,58 +4,249 @@
 #include <ostream>
 
 #include "DirectOutputImpl.h"
+#include "Tracer.h"
+#include "TrafficLog.h"
 #include "types.h"
 #include "utils.h"
 #include <DirectOutput.h>
 #include <string>
+#include <limits>
+#include <algorithm>
+#include <utility>
 
 namespace direct_output_proxy {
-	DirectOutputDevice::DirectOutputDevice(CDirectOutput* direct_output, void* handle)
-		: direct_output_(direct_output), handle_(handle) {
+	namespace {
+		const std::wstring& GetLine(const PageData& data, const DWORD line) {
+			switch (line) {
+			case kTopLine:
+				return data.top;
+			case kMiddleLine:
+				return data.middle;
+			default:
+				return data.bottom;
+			}
+		}
+	}
+
+	DirectOutputDevice::DirectOutputDevice(CDirectOutput* direct_output, void* handle, SdkEventDispatcher* events,
+		const DeviceCaps& caps)
+		: direct_output_(direct_output), handle_(handle), events_(events), caps_(caps), regions_(caps.line_width),
+		executor_([this]() { return Recover(); }) {
 	}
 
 	HRESULT DirectOutputDevice::Init() {
-		GUID dev_type;
-		CHECK_RETURN("GetDeviceType", direct_output_->GetDeviceType(handle_, &dev_type));
-		type_ = DeviceTypeGuidToDeviceType(dev_type);
-		DebugW() << "Detected: " << DevTypeToString(type_) << std::endl;
+		return RunWrite([this](PageVersion*) -> HRESULT {
+			DebugW() << "Detected: " << DevTypeToString(caps_.type) << std::endl;
 
-		for (const auto& [page, data] : pages_) {
-			CHECK_RETURN("AddPage", direct_output_->AddPage(handle_, page, data.name.c_str(), page == 0 ? FLAG_SET_AS_ACTIVE : 0));
-		}
-		HandlePageCallback(0, true);
+			for (DWORD slot = 0; slot < slots_.size(); ++slot) {
+				if (!slots_[slot].has_value()) continue;
+				const PageData& data = pages_.at(slots_[slot].value());
+				CHECK_RETURN("AddPage", SdkAddPage(slot, data.name, slot == 0 ? FLAG_SET_AS_ACTIVE : 0));
+			}
+			HandlePageCallback(0, true);
 
-		CHECK_RETURN("RegisterPageCallback", direct_output_->RegisterPageCallback(handle_, &PageCallback, this));
-		CHECK_RETURN("RegisterButtonCallback", direct_output_->RegisterSoftButtonCallback(handle_, &ButtonCallback, this));
-		return S_OK;
+			CHECK_RETURN("RegisterPageCallback", direct_output_->RegisterPageCallback(handle_, &PageCallback, events_));
+			CHECK_RETURN("RegisterButtonCallback", direct_output_->RegisterSoftButtonCallback(handle_, &ButtonCallback, events_));
+			return S_OK;
+		});
+	}
+
+	std::optional<DWORD> DirectOutputDevice::GetShownPage() {
+		if (!current_page_.has_value() || current_page_.value() >= slots_.size()) return std::nullopt;
+		return slots_[current_page_.value()];
 	}
 
 	HRESULT DirectOutputDevice::UpdatePage() {
-		if (!current_page_.has_value()) return S_OK;
-		DWORD page = current_page_.value();
+		TraceSpan span("DirectOutputDevice::UpdatePage");
+		shown_lines_.reset();
+		std::optional<DWORD> page = GetShownPage();
+		if (!page.has_value()) return S_OK;
+		DWORD slot = current_page_.value();
 
-		auto it = pages_.find(page);
+		auto it = pages_.find(page.value());
 		if (it == pages_.end()) return S_OK;
-		PageData& data = it->second;
+		PageData data = it->second;
+		data.top = regions_.Compose(page.value(), kTopLine, data.top);
+		data.middle = regions_.Compose(page.value(), kMiddleLine, data.middle);
+		data.bottom = regions_.Compose(page.value(), kBottomLine, data.bottom);
 
-		CHECK_RETURN("SetString Top", direct_output_->SetString(handle_, page, kTopLine,
-			static_cast<DWORD>(data.top.length()), data.top.c_str()));
-		CHECK_RETURN("SetString Middle", direct_output_->SetString(handle_, page, kMiddleLine,
-			static_cast<DWORD>(data.middle.length()), data.middle.c_str()));
-		CHECK_RETURN("SetString Bottom", direct_output_->SetString(handle_, page, kBottomLine,
-			static_cast<DWORD>(data.bottom.length()), data.bottom.c_str()));
+		RETURN_IF_ERROR(WriteContent(slot, data));
+		shown_lines_ = { data.top, data.middle, data.bottom };
+		for (const auto& [index, value] : data.leds) {
+			CHECK_RETURN("SetLed", SdkSetLed(slot, index, value));
+		}
+
+		return S_OK;
+	}
+
+	HRESULT DirectOutputDevice::UpdatePage(const DWORD page) {
+		if (GetShownPage() != page) return S_OK;
+		return UpdatePage();
+	}
+
+	HRESULT DirectOutputDevice::FlushLines(const DWORD page) {
+		if (GetShownPage() != page) return S_OK;
+		if (!shown_lines_.has_value()) return UpdatePage();
 
+		const PageData& data = pages_.at(page);
+		for (DWORD line = 0; line < caps_.lines; ++line) {
+			std::wstring composed = regions_.Compose(page, static_cast<LineIndex>(line), GetLine(data, line));
+			std::wstring& shown = shown_lines_.value()[line];
+			if (composed == shown) continue;
+			CHECK_RETURN("SetString", WriteLine(current_page_.value(), static_cast<LineIndex>(line), composed));
+			shown = std::move(composed);
+		}
 		return S_OK;
 	}
 
+	void DirectOutputDevice::Touch(const DWORD page) {
+		last_used_[page] = ++use_clock_;
+	}
+
+	std::pair<int64_t, uint64_t> DirectOutputDevice::GetResidencyRank(const DWORD page) {
+		const PageData& data = pages_.at(page);
+		int64_t priority = 0;
+		switch (data.residency) {
+		case ResidencyPolicy::kPinned:
+			priority = std::numeric_limits<int64_t>::max();
+			break;
+		case ResidencyPolicy::kPriority:
+			priority = data.priority;
+			break;
+		case ResidencyPolicy::kLru:
+			break;
+		}
+		return { priority, last_used_[page] };
+	}
+
+	std::optional<DWORD> DirectOutputDevice::FindFreeSlot() {
+		for (DWORD slot = 0; slot < slots_.size(); ++slot) {
+			if (!slots_[slot].has_value()) return slot;
+		}
+		if (slots_.size() < kMaxResidentPages) {
+			slots_.emplace_back();
+			return static_cast<DWORD>(slots_.size() - 1);
+		}
+		return std::nullopt;
+	}
+
+	std::optional<DWORD> DirectOutputDevice::FindEvictionCandidate() {
+		std::optional<DWORD> shown = GetShownPage();
+		std::optional<DWORD> candidate;
+		for (const auto& [page, slot] : slot_of_) {
+			if (page == shown || pages_.at(page).residency == ResidencyPolicy::kPinned) continue;
+			if (!candidate.has_value() || GetResidencyRank(page) < GetResidencyRank(candidate.value())) {
+				candidate = page;
+			}
+		}
+		return candidate;
+	}
+
+	std::optional<DWORD> DirectOutputDevice::FindSwapInCandidate() {
+		std::optional<DWORD> candidate;
+		for (const auto& [page, data] : pages_) {
+			if (slot_of_.contains(page)) continue;
+			if (!candidate.has_value() || GetResidencyRank(page) > GetResidencyRank(candidate.value())) {
+				candidate = page;
+			}
+		}
+		return candidate;
+	}
+
+	HRESULT DirectOutputDevice::MakeResident(const DWORD page, const bool activate) {
+		TraceSpan span("DirectOutputDevice::MakeResident");
+		if (slot_of_.contains(page)) return S_OK;
+
+		const PageData& data = pages_.at(page);
+		std::optional<DWORD> slot = FindFreeSlot();
+		if (!slot.has_value()) {
+			std::optional<DWORD> victim = FindEvictionCandidate();
+			if (!victim.has_value() || GetResidencyRank(victim.value()) >= GetResidencyRank(page)) return S_OK;
+
+			slot = slot_of_.at(victim.value());
+			Debug() << "device: " << handle_ << " slot " << slot.value() << ": page " << victim.value() << " -> " << page << std::endl;
+			if (!activate) {
+				// Not shown, so nothing is written until the user turns to it.
+				slot_of_.erase(victim.value());
+				slots_[slot.value()] = page;
+				slot_of_[page] = slot.value();
+				return S_OK;
+			}
+			// Activating a page is only possible when adding it.
+			CHECK_RETURN("RemovePage", SdkRemovePage(slot.value()));
+			slot_of_.erase(victim.value());
+			slots_[slot.value()].reset();
+		}
+
+		CHECK_RETURN("AddPage", SdkAddPage(slot.value(), data.name, activate ? FLAG_SET_AS_ACTIVE : 0));
+		const std::optional<DWORD> current = current_page_;
+		slots_[slot.value()] = page;
+		slot_of_[page] = slot.value();
+		if (activate) current_page_ = slot;
+		const HRESULT result = UpdatePage(page);
+		if (FAILED(result)) {
+			// Leaves the page virtual, as if it had never been added.
+			CHECK_ERROR("RemovePage", SdkRemovePage(slot.value()));
+			slots_[slot.value()].reset();
+			slot_of_.erase(page);
+			current_page_ = current;
+			return result;
+		}
+		if (activate) PublishState({ .change = StateChange::kPageActivated, .page = page });
+		return S_OK;
+	}
+
+	void __stdcall DirectOutputDevice::PageCallback(void* handle, DWORD page, bool activated, void* param) {
+		SdkEventDispatcher* events = (SdkEventDispatcher*)param;
+		events->Push({ .type = SdkEventType::kPage, .device = handle, .value = page, .activated = activated,
+			.time = std::chrono::steady_clock::now() });
+	}
+
+	void __stdcall DirectOutputDevice::ButtonCallback(void* handle, DWORD buttons, void* param) {
+		SdkEventDispatcher* events = (SdkEventDispatcher*)param;
+		events->Push({ .type = SdkEventType::kButtons, .device = handle, .value = buttons,
+			.time = std::chrono::steady_clock::now() });
+	}
+
+	void DirectOutputDevice::HandleEvent(const SdkEvent& event) {
+		switch (event.type) {
+		case SdkEventType::kPage:
+			if (recorder_ != nullptr) recorder_->RecordPage(caps_.type, event.value, event.activated);
+			break;
+		case SdkEventType::kButtons:
+			if (recorder_ != nullptr) recorder_->RecordButtons(caps_.type, event.value);
+			break;
+		default:
+			return;
+		}
+		// Handled on the worker, so the dispatcher doesn't wait for the device. The user waits for what's written
+		// in response, e.g. the page they turned to, so it goes before queued writes.
+		executor_.Post(WriteLane::kInteractive, [this, event]() {
+			if (event.type == SdkEventType::kPage) {
+				std::unique_lock lock(mutex_);
+				HandlePageCallback(event.value, event.activated);
+				EndTask(lock);
+			} else {
+				HandleButtonCallback(event.value);
+			}
+		});
+	}
+
 	void DirectOutputDevice::HandlePageCallback(const DWORD page, const bool activated) {
 		Debug() << "device: " << handle_ << " page: " << page << " active : " << activated << std::endl;
 		if (!activated) {
 			if (current_page_ == page) {
+				std::optional<DWORD> shown = GetShownPage();
 				current_page_.reset();
+				if (shown.has_value()) PublishState({ .change = StateChange::kPageDeactivated, .page = shown.value() });
 			}
 		} else {
 			current_page_ = page;
+			std::optional<DWORD> shown = GetShownPage();
+			if (shown.has_value()) {
+				Touch(shown.value());
+				PublishState({ .change = StateChange::kPageActivated, .page = shown.value() });
+			}
 			UpdatePage();
 		}
 	}
@@ -63,74 +254,491 @@ namespace direct_output_proxy {
 	void DirectOutputDevice::HandleButtonCallback(const DWORD buttons) {
 		Debug() << "device: " << handle_ << " buttons: " << buttons << std::endl;
 
-		DWORD page = current_page_.has_value() ? current_page_.value() : -1;
-
-		for (const DWORD button : kButtons) {
-			if ((buttons & button) && !(buttons_ & button)) {
-				DebugW() << "Button " << ButtonToString(button) << " down on page " << page << std::endl;
-				if (button_callback_) {
-					button_callback_(button, /*down=*/true, page);
-				}
-			} else if (!(buttons & button) && (buttons_ & button)) {
-				DebugW() << "Button " << ButtonToString(button) << " up on page " << page << std::endl;
-				if (button_callback_) {
-					button_callback_(button, /*down=*/false, page);
+		std::vector<std::pair<DWORD, bool>> changes;
+		ButtonEventCallback callback;
+		DWORD page = -1;
+		{
+			std::lock_guard lock(mutex_);
+			page = GetShownPage().value_or(-1);
+			for (const ButtonInfo& info : caps_.buttons) {
+				const DWORD button = info.bit;
+				if ((buttons & button) && !(buttons_ & button)) {
+					DebugW() << "Button " << info.name << " down on page " << page << std::endl;
+					changes.push_back({ button, /*down=*/true });
+				} else if (!(buttons & button) && (buttons_ & button)) {
+					DebugW() << "Button " << info.name << " up on page " << page << std::endl;
+					changes.push_back({ button, /*down=*/false });
 				}
 			}
+			buttons_ = buttons;
+			callback = button_callback_;
 		}
-		buttons_ = buttons;
+
+		// Without the lock, as the callback may write to the device. Its writes run inline, on the worker.
+		if (!callback) return;
+		for (const auto& [button, down] : changes) callback(button, down, page);
 	}
 
-	HRESULT DirectOutputDevice::AddPage(const DWORD page, const PageData& data, const bool activate) {
-		if (pages_.contains(page)) return -ERROR_ALREADY_EXISTS;
-		pages_[page] = data;
-		CHECK_RETURN("AddPage", direct_output_->AddPage(handle_, page, data.name.c_str(), activate ? FLAG_SET_AS_ACTIVE : 0));
-		if (activate) current_page_ = page;
-		return UpdatePage();
+	HRESULT DirectOutputDevice::RunSdkCall(std::function<HRESULT()> call) {
+		// Readers don't wait for the device while the worker does.
+		mutex_.unlock();
+		const HRESULT result = executor_.Run(std::move(call));
+		mutex_.lock();
+		return result;
 	}
 
-	HRESULT DirectOutputDevice::SetPage(const DWORD page, const PageData& data) {
-		if (!pages_.contains(page)) return -ERROR_NOT_FOUND;
-		pages_[page] = data;
-		return UpdatePage();
+	HRESULT DirectOutputDevice::SdkAddPage(const DWORD slot, std::wstring name, const DWORD flags) {
+		return RunSdkCall([direct_output = direct_output_, handle = handle_, slot, name = std::move(name), flags]() {
+			TraceSpan span("CDirectOutput::AddPage");
+			return direct_output->AddPage(handle, slot, name.c_str(), flags);
+		});
+	}
+
+	HRESULT DirectOutputDevice::SdkRemovePage(const DWORD slot) {
+		// The files saved on the page go with it.
+		for (std::optional<DeviceFile>& file : files_) {
+			if (file.has_value() && file->slot == slot) file.reset();
+		}
+		return RunSdkCall([direct_output = direct_output_, handle = handle_, slot]() {
+			TraceSpan span("CDirectOutput::RemovePage");
+			return direct_output->RemovePage(handle, slot);
+		});
+	}
+
+	HRESULT DirectOutputDevice::SdkSetString(const DWORD slot, const LineIndex line, std::wstring content) {
+		return RunSdkCall([direct_output = direct_output_, handle = handle_, slot, line, content = std::move(content)]() {
+			TraceSpan span("CDirectOutput::SetString");
+			return direct_output->SetString(handle, slot, line, static_cast<DWORD>(content.length()), content.c_str());
+		});
 	}
 
-	HRESULT DirectOutputDevice::RemovePage(const DWORD page) {
-		if (!pages_.contains(page)) return -ERROR_NOT_FOUND;
-		pages_.erase(page);
-		CHECK_RETURN("RemovePage", direct_output_->RemovePage(handle_, page));
+	HRESULT DirectOutputDevice::SdkSetLed(const DWORD slot, const DWORD index, const DWORD value) {
+		return RunSdkCall([direct_output = direct_output_, handle = handle_, slot, index, value]() {
+			TraceSpan span("CDirectOutput::SetLed");
+			return direct_output->SetLed(handle, slot, index, value);
+		});
+	}
+
+	HRESULT DirectOutputDevice::SdkSaveFile(const DWORD slot, const DWORD file, LibraryImage image) {
+		return RunSdkCall([direct_output = direct_output_, handle = handle_, slot, file, image = std::move(image)]() {
+			TraceSpan span("CDirectOutput::SaveFile");
+			return direct_output->SaveFile(handle, slot, file, static_cast<DWORD>(image.path.length()), image.path.c_str(), nullptr);
+		});
+	}
+
+	HRESULT DirectOutputDevice::SdkDisplayFile(const DWORD slot, const DWORD file) {
+		return RunSdkCall([direct_output = direct_output_, handle = handle_, slot, file]() {
+			TraceSpan span("CDirectOutput::DisplayFile");
+			return direct_output->DisplayFile(handle, slot, 0, file, nullptr);
+		});
+	}
+
+	HRESULT DirectOutputDevice::SdkDeleteFile(const DWORD slot, const DWORD file) {
+		return RunSdkCall([direct_output = direct_output_, handle = handle_, slot, file]() {
+			TraceSpan span("CDirectOutput::DeleteFile");
+			return direct_output->DeleteFile(handle, slot, file, nullptr);
+		});
+	}
+
+	DWORD DirectOutputDevice::AllocateFile() {
+		std::optional<DWORD> victim;
+		for (DWORD file = 0; file < files_.size(); ++file) {
+			if (!files_[file].has_value()) return file;
+			if (!victim.has_value() || files_[file]->last_used < files_[victim.value()]->last_used) victim = file;
+		}
+
+		const DeviceFile& evicted = files_[victim.value()].value();
+		Debug() << "device: " << handle_ << " file " << victim.value() << ": evicting image " << evicted.image << std::endl;
+		// The file is overwritten anyway, so a failure only leaves a stale file behind.
+		CHECK_ERROR("DeleteFile", SdkDeleteFile(evicted.slot, victim.value()));
+		files_[victim.value()].reset();
+		++image_evictions_;
+		return victim.value();
+	}
+
+	HRESULT DirectOutputDevice::DisplayImage(const DWORD slot, const std::string& image) {
+		TraceSpan span("DirectOutputDevice::DisplayImage");
+		if (image_library_ == nullptr) return E_NOTIMPL;
+		std::optional<LibraryImage> library_image = image_library_->Get(image);
+		if (!library_image.has_value()) return -ERROR_NOT_FOUND;
+
+		std::optional<DWORD> file;
+		for (DWORD candidate = 0; candidate < files_.size(); ++candidate) {
+			const std::optional<DeviceFile>& entry = files_[candidate];
+			if (entry.has_value() && entry->slot == slot && entry->image == image &&
+				entry->image_version == library_image->version) {
+				file = candidate;
+				break;
+			}
+		}
+
+		if (file.has_value()) {
+			++image_hits_;
+		} else {
+			++image_misses_;
+			file = AllocateFile();
+			const uint64_t image_version = library_image->version;
+			CHECK_RETURN("SaveFile", SdkSaveFile(slot, file.value(), std::move(library_image.value())));
+			files_[file.value()] = DeviceFile{ .slot = slot, .image = image, .image_version = image_version };
+		}
+		files_[file.value()]->last_used = ++use_clock_;
+		CHECK_RETURN("DisplayFile", SdkDisplayFile(slot, file.value()));
 		return S_OK;
 	}
 
-	HRESULT DirectOutputDevice::SetLine(const DWORD page, const LineIndex line, const std::wstring& content) {
-		auto it = pages_.find(page);
-		if (it == pages_.end()) return -ERROR_NOT_FOUND;
+	HRESULT DirectOutputDevice::Recover() {
+		// What to write, copied under the lock. The SDK calls below may stall past the executor stopping and the
+		// device going away, so they only use the copies.
+		struct Slot {
+			DWORD slot = 0;
+			std::wstring name;
+		};
+		std::vector<Slot> slots;
+		std::optional<DWORD> shown_slot;
+		std::vector<std::wstring> lines;
+		std::map<DWORD, DWORD> leds;
+		std::optional<LibraryImage> image;
+		CDirectOutput* direct_output = direct_output_;
+		void* handle = handle_;
+		{
+			std::lock_guard lock(mutex_);
+			for (DWORD slot = 0; slot < slots_.size(); ++slot) {
+				if (slots_[slot].has_value()) slots.push_back({ .slot = slot, .name = pages_.at(slots_[slot].value()).name });
+			}
+			std::optional<DWORD> page = GetShownPage();
+			if (page.has_value()) {
+				shown_slot = current_page_;
+				const PageData& data = pages_.at(page.value());
+				for (DWORD line = 0; line < caps_.lines; ++line) {
+					lines.push_back(regions_.Compose(page.value(), static_cast<LineIndex>(line), GetLine(data, line)).substr(0, caps_.line_width));
+				}
+				leds = data.leds;
+				if (caps_.image && !data.image.empty() && image_library_ != nullptr) image = image_library_->Get(data.image);
+			}
+			// Saved images may be lost too; they are saved again when shown. The shown lines are written below,
+			// but whether that works is only known later.
+			for (std::optional<DeviceFile>& file : files_) file.reset();
+			shown_lines_.reset();
+		}
+
+		GUID dev_type;
+		RETURN_IF_ERROR(direct_output->GetDeviceType(handle, &dev_type));
 
-		switch (line) {
-		case kTopLine:
-			it->second.top = content;
-			break;
-		case kMiddleLine:
-			it->second.middle = content;
-			break;
-		case kBottomLine:
-			it->second.bottom = content;
-			break;
+		Debug() << "device: " << handle << " responding again, restoring " << slots.size() << " pages" << std::endl;
+		for (const Slot& slot : slots) {
+			// The device may or may not have kept the page.
+			direct_output->RemovePage(handle, slot.slot);
+			CHECK_RETURN("AddPage", direct_output->AddPage(handle, slot.slot, slot.name.c_str(),
+				slot.slot == shown_slot ? FLAG_SET_AS_ACTIVE : 0));
 		}
-		return UpdatePage();
+		if (!shown_slot.has_value()) return S_OK;
+		for (DWORD line = 0; line < lines.size(); ++line) {
+			CHECK_RETURN("SetString", direct_output->SetString(handle, shown_slot.value(), line,
+				static_cast<DWORD>(lines[line].length()), lines[line].c_str()));
+		}
+		for (const auto& [index, value] : leds) {
+			CHECK_RETURN("SetLed", direct_output->SetLed(handle, shown_slot.value(), index, value));
+		}
+		if (image.has_value()) {
+			CHECK_RETURN("SetImageFromFile", direct_output->SetImageFromFile(handle, shown_slot.value(), 0,
+				static_cast<DWORD>(image->path.length()), image->path.c_str()));
+		}
+		return S_OK;
+	}
+
+	HRESULT DirectOutputDevice::CheckVersion(const DWORD page, const std::optional<PageVersion> if_match) {
+		if (if_match.has_value() && if_match.value() != CurrentVersion(page)) return -ERROR_REVISION_MISMATCH;
+		return S_OK;
+	}
+
+	void DirectOutputDevice::CommitVersion(const DWORD page, const bool changed, PageVersion* version) {
+		PageVersion& current = versions_[page];
+		if (changed) ++current;
+		if (version != nullptr) *version = current;
+	}
+
+	HRESULT DirectOutputDevice::RestorePage(const DWORD page, const PageData& previous, const HRESULT result) {
+		pages_[page] = previous;
+		// Some lines may have been written before the failure, so the next write rewrites the page.
+		if (GetShownPage() == page) shown_lines_.reset();
+		return result;
+	}
+
+	void DirectOutputDevice::PublishState(StateEvent event) {
+		if (!state_callback_) return;
+		event.device = caps_.type;
+		event.device_id = id_;
+		pending_state_.push_back(std::move(event));
+	}
+
+	void DirectOutputDevice::PublishLines(const DWORD page, const PageData* previous) {
+		if (!state_callback_) return;
+		const PageData& data = pages_.at(page);
+		for (DWORD line = 0; line < caps_.lines; ++line) {
+			const std::wstring& content = GetLine(data, line);
+			if (previous == nullptr ? content.empty() : content == GetLine(*previous, line)) continue;
+			PublishState({ .change = StateChange::kLine, .page = page, .line = static_cast<LineIndex>(line),
+				.version = CurrentVersion(page), .text = content });
+		}
+	}
+
+	void DirectOutputDevice::ForEachPage(const std::function<void(DWORD page, const PageData& data, PageVersion version)>& fn) {
+		const std::shared_ptr<const Snapshot> snapshot = snapshot_.load();
+		for (const auto& [page, data] : snapshot->pages) fn(page, data, snapshot->GetVersion(page));
+	}
+
+	PageVersion DirectOutputDevice::GetPageVersion(const DWORD page) {
+		return snapshot_.load()->GetVersion(page);
+	}
+
+	PageVersion DirectOutputDevice::CurrentVersion(const DWORD page) {
+		auto it = versions_.find(page);
+		return it == versions_.end() ? 0 : it->second;
+	}
+
+	HRESULT DirectOutputDevice::RunWrite(std::function<HRESULT(PageVersion* version)> write, PageVersion* version) {
+		// The task may outlive this call if it times out, so it reports the version through a copy it shares.
+		auto written = std::make_shared<PageVersion>(0);
+		const HRESULT result = executor_.Submit([this, write = std::move(write), written]() {
+			std::unique_lock lock(mutex_);
+			const HRESULT result = write(written.get());
+			EndTask(lock);
+			return result;
+		});
+		if (SUCCEEDED(result) && version != nullptr) *version = *written;
+		return result;
+	}
+
+	void DirectOutputDevice::EndTask(std::unique_lock<std::mutex>& lock) {
+		auto snapshot = std::make_shared<Snapshot>();
+		snapshot->pages = pages_;
+		snapshot->versions = versions_;
+		snapshot->shown = GetShownPage();
+		snapshot_.store(std::move(snapshot));
+
+		std::vector<StateEvent> events;
+		events.swap(pending_state_);
+		lock.unlock();
+		for (const StateEvent& event : events) state_callback_(event);
+	}
+
+	HRESULT DirectOutputDevice::AddPage(const DWORD page, const PageData& data, const bool activate,
+		const std::optional<PageVersion> if_match, PageVersion* version) {
+		TraceSpan span("DirectOutputDevice::AddPage");
+		return RunWrite([=, this](PageVersion* version) -> HRESULT {
+			if (pages_.contains(page)) return -ERROR_ALREADY_EXISTS;
+			RETURN_IF_ERROR(CheckVersion(page, if_match));
+			pages_[page] = data;
+			Touch(page);
+
+			// A failed add leaves no trace: MakeResident() undid what it did, and the version isn't bumped.
+			HRESULT result = MakeResident(page, activate);
+			if (SUCCEEDED(result) && data.residency == ResidencyPolicy::kPinned && !slot_of_.contains(page)) {
+				result = E_OUTOFMEMORY;
+			}
+			if (FAILED(result)) {
+				pages_.erase(page);
+				last_used_.erase(page);
+				return result;
+			}
+			CommitVersion(page, /*changed=*/true, version);
+			PublishState({ .change = StateChange::kPageAdded, .page = page, .version = CurrentVersion(page), .text = data.name });
+			PublishLines(page, nullptr);
+			return S_OK;
+		}, version);
+	}
+
+	HRESULT DirectOutputDevice::SetPage(const DWORD page, const PageData& data,
+		const std::optional<PageVersion> if_match, PageVersion* version) {
+		TraceSpan span("DirectOutputDevice::SetPage");
+		return RunWrite([=, this](PageVersion* version) -> HRESULT {
+			if (!pages_.contains(page)) return -ERROR_NOT_FOUND;
+			RETURN_IF_ERROR(CheckVersion(page, if_match));
+			const PageData previous = std::exchange(pages_[page], data);
+			Touch(page);
+			const HRESULT result = slot_of_.contains(page) ? UpdatePage(page) : MakeResident(page, /*activate=*/false);
+			if (FAILED(result)) return RestorePage(page, previous, result);
+			CommitVersion(page, data != previous, version);
+			if (data.name != previous.name) {
+				PublishState({ .change = StateChange::kPageAdded, .page = page, .version = CurrentVersion(page), .text = data.name });
+			}
+			PublishLines(page, &previous);
+			return S_OK;
+		}, version);
+	}
+
+	HRESULT DirectOutputDevice::RemovePage(const DWORD page,
+		const std::optional<PageVersion> if_match, PageVersion* version) {
+		TraceSpan span("DirectOutputDevice::RemovePage");
+		return RunWrite([=, this](PageVersion* version) -> HRESULT {
+			if (!pages_.contains(page)) return -ERROR_NOT_FOUND;
+			RETURN_IF_ERROR(CheckVersion(page, if_match));
+			pages_.erase(page);
+			last_used_.erase(page);
+			regions_.RemovePage(page);
+			CommitVersion(page, /*changed=*/true, version);
+			PublishState({ .change = StateChange::kPageRemoved, .page = page, .version = CurrentVersion(page) });
+
+			auto it = slot_of_.find(page);
+			if (it == slot_of_.end()) return S_OK;
+			DWORD slot = it->second;
+			slot_of_.erase(it);
+			slots_[slot].reset();
+
+			// Reuse the slot for a virtual page rather than removing it from the device.
+			std::optional<DWORD> next = FindSwapInCandidate();
+			if (next.has_value()) {
+				slots_[slot] = next;
+				slot_of_[next.value()] = slot;
+				return UpdatePage(next.value());
+			}
+			CHECK_RETURN("RemovePage", SdkRemovePage(slot));
+			return S_OK;
+		}, version);
+	}
+
+	HRESULT DirectOutputDevice::SetLine(const DWORD page, const LineIndex line, const std::wstring& content,
+		const std::optional<PageVersion> if_match, PageVersion* version) {
+		TraceSpan span("DirectOutputDevice::SetLine");
+		if (!HasLine(line)) return E_INVALIDARG;
+		return RunWrite([=, this](PageVersion* version) -> HRESULT {
+			auto it = pages_.find(page);
+			if (it == pages_.end()) return -ERROR_NOT_FOUND;
+			RETURN_IF_ERROR(CheckVersion(page, if_match));
+
+			const PageData previous = it->second;
+			const bool changed = GetLine(previous, line) != content;
+			switch (line) {
+			case kTopLine:
+				it->second.top = content;
+				break;
+			case kMiddleLine:
+				it->second.middle = content;
+				break;
+			case kBottomLine:
+				it->second.bottom = content;
+				break;
+			}
+			Touch(page);
+			const HRESULT result = slot_of_.contains(page) ? FlushLines(page) : MakeResident(page, /*activate=*/false);
+			if (FAILED(result)) return RestorePage(page, previous, result);
+			CommitVersion(page, changed, version);
+			if (changed) {
+				PublishState({ .change = StateChange::kLine, .page = page, .line = line, .version = CurrentVersion(page), .text = content });
+			}
+			return S_OK;
+		}, version);
+	}
+
+	HRESULT DirectOutputDevice::SetLed(const DWORD page, const DWORD index, const DWORD value,
+		const std::optional<PageVersion> if_match, PageVersion* version) {
+		TraceSpan span("DirectOutputDevice::SetLed");
+		if (!HasLed(index)) return E_INVALIDARG;
+		return RunWrite([=, this](PageVersion* version) -> HRESULT {
+			auto it = pages_.find(page);
+			if (it == pages_.end()) return -ERROR_NOT_FOUND;
+			RETURN_IF_ERROR(CheckVersion(page, if_match));
+
+			const PageData previous = it->second;
+			const bool changed = !previous.leds.contains(index) || previous.leds.at(index) != value;
+			it->second.leds[index] = value;
+			Touch(page);
+			HRESULT result = S_OK;
+			if (!slot_of_.contains(page)) {
+				result = MakeResident(page, /*activate=*/false);
+			} else if (GetShownPage() == page) {
+				result = CHECK_ERROR("SetLed", SdkSetLed(current_page_.value(), index, value));
+			}
+			if (FAILED(result)) return RestorePage(page, previous, result);
+			CommitVersion(page, changed, version);
+			return S_OK;
+		}, version);
+	}
+
+	HRESULT DirectOutputDevice::SetImage(const DWORD page, const std::string& image,
+		const std::optional<PageVersion> if_match, PageVersion* version) {
+		TraceSpan span("DirectOutputDevice::SetImage");
+		if (!HasImage()) return E_NOTIMPL;
+		return RunWrite([=, this](PageVersion* version) -> HRESULT {
+			auto it = pages_.find(page);
+			if (it == pages_.end()) return -ERROR_NOT_FOUND;
+			RETURN_IF_ERROR(CheckVersion(page, if_match));
+
+			const PageData previous = it->second;
+			it->second.image = image;
+			Touch(page);
+			const HRESULT result = slot_of_.contains(page) ? UpdatePage(page) : MakeResident(page, /*activate=*/false);
+			if (FAILED(result)) return RestorePage(page, previous, result);
+			CommitVersion(page, image != previous.image, version);
+			return S_OK;
+		}, version);
+	}
+
+	HRESULT DirectOutputDevice::SetRegion(const DWORD page, const RegionKey& key, const Region& region) {
+		TraceSpan span("DirectOutputDevice::SetRegion");
+		if (!HasLine(region.line) || !HasColumn(region.column)) return E_INVALIDARG;
+		return RunWrite([=, this](PageVersion*) -> HRESULT {
+			if (!pages_.contains(page)) return -ERROR_NOT_FOUND;
+
+			regions_.Set(page, key, region);
+			Touch(page);
+			if (!slot_of_.contains(page)) return MakeResident(page, /*activate=*/false);
+			return FlushLines(page);
+		});
+	}
+
+	HRESULT DirectOutputDevice::RemoveRegion(const DWORD page, const RegionKey& key) {
+		TraceSpan span("DirectOutputDevice::RemoveRegion");
+		return RunWrite([=, this](PageVersion*) -> HRESULT {
+			if (!regions_.Remove(page, key).has_value()) return -ERROR_NOT_FOUND;
+			return FlushLines(page);
+		});
+	}
+
+	void DirectOutputDevice::ExpireRegions(const std::chrono::steady_clock::time_point now) {
+		// The compositor is thread-safe; only rewriting the lines needs the worker.
+		std::vector<DWORD> pages = regions_.Expire(now);
+		if (pages.empty()) return;
+		executor_.Post(WriteLane::kBulk, [this, pages = std::move(pages)]() {
+			std::unique_lock lock(mutex_);
+			for (const DWORD page : pages) {
+				Debug() << "device: " << handle_ << " page " << page << ": regions expired" << std::endl;
+				// While the device is unavailable the lines are written once it recovers.
+				if (FAILED(executor_.CheckAvailable())) continue;
+				CHECK_ERROR("FlushLines", FlushLines(page));
+			}
+		});
 	}
 
 	std::wstring DirectOutputDevice::GetInfo() {
-		std::wstring info = L"device type: " + DevTypeToString(type_);
-		info += L"\npages: " + std::to_wstring(pages_.size());
+		std::lock_guard lock(mutex_);
+		std::wstring info = L"device type: " + DevTypeToString(caps_.type);
+		info += L"\npages: " + std::to_wstring(pages_.size()) + L", resident: " + std::to_wstring(slot_of_.size()) +
+			L", regions: " + std::to_wstring(regions_.GetSize());
+		std::optional<DWORD> shown = GetShownPage();
 		for (const auto& [page, data] : pages_) {
 			info += L"\npage " + std::to_wstring(page) + L": '" + data.top + L"', '" + data.middle + L"', '" + data.bottom + L"'";
-			if (page == current_page_) {
+			info += L" v" + std::to_wstring(CurrentVersion(page));
+			auto slot = slot_of_.find(page);
+			if (slot == slot_of_.end()) {
+				info += L" [virtual]";
+			} else {
+				info += L" [slot " + std::to_wstring(slot->second) + L"]";
+			}
+			if (page == shown) {
 				info += L" [current]";
 			}
 		}
-		if (current_page_.has_value()) {
-			info += L"\nCurrent page: " + std::to_wstring(current_page_.value());
+		info += L"\n" + executor_.GetInfo();
+		if (caps_.image) {
+			const size_t saved = std::count_if(files_.begin(), files_.end(), [](const auto& file) { return file.has_value(); });
+			const uint64_t lookups = image_hits_ + image_misses_;
+			info += L"\nimage cache: " + std::to_wstring(saved) + L"/" + std::to_wstring(kMaxDeviceFiles) + L" files, hits: " +
+				std::to_wstring(image_hits_) + L", misses: " + std::to_wstring(image_misses_) + L", hit rate: " +
+				std::to_wstring(lookups == 0 ? 0 : image_hits_ * 100 / lookups) + L"%, evictions: " + std::to_wstring(image_evictions_);
+		}
+		if (shown.has_value()) {
+			info += L"\nCurrent page: " + std::to_wstring(shown.value());
 		} else {
 			info += L"\nCurrent page: mode";
 		}
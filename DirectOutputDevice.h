@@ -1,56 +1,294 @@
 #pragma once
 
 #include <Windows.h>
+#include "DeviceExecutor.h"
+#include "DeviceTraits.h"
 #include "DirectOutputImpl.h"
+#include "ImageLibrary.h"
+#include "RegionCompositor.h"
+#include "SdkEventDispatcher.h"
 #include "types.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <optional>
 #include <string>
 #include <functional>
+#include <map>
+#include <mutex>
 #include <utility>
+#include <vector>
 
 namespace direct_output_proxy {
+	class TrafficRecorder;
+
 	using ButtonEventCallback = std::function<void(DWORD button, bool down, DWORD page)>;
+	using StateEventCallback = std::function<void(const StateEvent& event)>;
+
+	// How many pages are added to the device at most. Further pages are kept by the proxy only.
+	constexpr DWORD kMaxResidentPages = 8;
+
+	// How many image files are saved on a FIP at most. Further images replace the least recently shown one.
+	constexpr DWORD kMaxDeviceFiles = 16;
 
+	// Pages seen by clients are virtual: any number of them can exist, and up to kMaxResidentPages of them are
+	// resident, i.e. mapped to a slot, which is a page on the device. The residency policy of each page decides
+	// which pages get a slot. Swapping a page in reuses the slot of the evicted page, only rewriting its lines.
+	// SDK calls go through a DeviceExecutor. While its breaker is open the write methods fail with
+	// -ERROR_SERVICE_NOT_ACTIVE, and once the device responds again the resident pages are written back.
+	// What a page shows depends on the device type; devices are created as a TypedDevice by MakeDevice().
+	// Thread-safe: the write methods, Init(), HandleEvent() and ExpireRegions() run as tasks on the executor's
+	// worker, one at a time, so callers wait for the device without holding the device lock. The worker holds
+	// the lock while it changes the device, but not during SDK calls. After every task it publishes a snapshot of
+	// the pages, which readers use without locking.
 	class DirectOutputDevice {
 	public:
-		DirectOutputDevice(CDirectOutput* direct_output, void* handle);
+		// The device's SDK callbacks are queued to `events`, whose handler should pass them to HandleEvent().
+		DirectOutputDevice(CDirectOutput* direct_output, void* handle, SdkEventDispatcher* events, const DeviceCaps& caps);
+		DirectOutputDevice(const DirectOutputDevice&) = delete;
+		DirectOutputDevice& operator=(const DirectOutputDevice&) = delete;
+		virtual ~DirectOutputDevice() = default;
 
 		HRESULT Init();
 
+		// The write methods below fail with -ERROR_REVISION_MISMATCH if `if_match` is set and differs from the
+		// current version of the page. On success the new version is stored in `version` if it's not null.
+		// A write only bumps the version and publishes its state events if it changed the page, and once it
+		// reached the device. A failed write leaves the page as it was.
+
 		// Adds a new page. Fails if the page already exists.
-		HRESULT AddPage(DWORD page, const PageData& data, bool activate);
+		// The version of a page which was never added is 0.
+		// The page gets a slot if one is free, or if it outranks a resident page. Fails with E_OUTOFMEMORY if a
+		// pinned page can't get a slot. `activate` only has an effect if the page gets a slot.
+		// A failed add leaves the device as it was: the page and its version are not kept.
+		HRESULT AddPage(DWORD page, const PageData& data, bool activate,
+			std::optional<PageVersion> if_match = std::nullopt, PageVersion* version = nullptr);
 
 		// Updates an existing page. Fails if the page does not exist.
-		HRESULT SetPage(DWORD page, const PageData& data);
+		HRESULT SetPage(DWORD page, const PageData& data,
+			std::optional<PageVersion> if_match = std::nullopt, PageVersion* version = nullptr);
 
 		// Removes an existing page.
-		HRESULT RemovePage(DWORD page);
+		HRESULT RemovePage(DWORD page,
+			std::optional<PageVersion> if_match = std::nullopt, PageVersion* version = nullptr);
+
+		// Updates a line on a page. Like any use of a page, this may swap the page in.
+		// Fails with E_INVALIDARG if the device has no such line.
+		HRESULT SetLine(DWORD page, LineIndex line, const std::wstring& content,
+			std::optional<PageVersion> if_match = std::nullopt, PageVersion* version = nullptr);
+
+		// Sets a LED on a page. Fails with E_INVALIDARG if the device has no such LED.
+		HRESULT SetLed(DWORD page, DWORD index, DWORD value,
+			std::optional<PageVersion> if_match = std::nullopt, PageVersion* version = nullptr);
+
+		// Only for devices with an image display. Shows an image from the ImageLibrary on a page. The image is saved to the device once, and
+		// displayed from there whenever the page is shown again.
+		HRESULT SetImage(DWORD page, const std::string& image,
+			std::optional<PageVersion> if_match = std::nullopt, PageVersion* version = nullptr);
+
+		// Adds or replaces the region `key` of a page, which is drawn over the line of the page; see RegionCompositor.
+		// Regions are not part of the page, so they don't change its version. Fails with E_INVALIDARG if the device
+		// has no such line or column.
+		HRESULT SetRegion(DWORD page, const RegionKey& key, const Region& region);
+
+		HRESULT RemoveRegion(DWORD page, const RegionKey& key);
 
-		// Updates a line on a page.
-		HRESULT SetLine(DWORD page, LineIndex line, const std::wstring& content);
+		// Removes the regions which expired by `now`, and rewrites the lines they were on.
+		void ExpireRegions(std::chrono::steady_clock::time_point now);
 
-		// Registers a callback which is called if there's a button event.
+		// Returns the version of a page as of the last finished write, also for removed pages.
+		PageVersion GetPageVersion(DWORD page);
+
+		// Registers a callback which is called if there's a button event. It's called on the worker, without the
+		// device lock, so it may write to the device.
 		void RegisterButtonCallback(ButtonEventCallback callback) {
+			std::lock_guard lock(mutex_);
 			button_callback_ = std::move(callback);
 		}
 
+		// Registers a callback which is called after every change of the pages, their lines, or the shown page.
+		// Must be called before Init().
+		void RegisterStateCallback(StateEventCallback callback) {
+			state_callback_ = std::move(callback);
+		}
+
+		// Returns the page shown on the device.
+		std::optional<DWORD> GetActivePage() {
+			return snapshot_.load()->shown;
+		}
+
+		// Calls `fn` with every page as of the last finished write, in page order.
+		void ForEachPage(const std::function<void(DWORD page, const PageData& data, PageVersion version)>& fn);
+
+		// Records the device callbacks. `recorder` must outlive the device.
+		void SetRecorder(TrafficRecorder* recorder) {
+			recorder_ = recorder;
+		}
+
+		// Where images shown with SetImage come from. `library` must outlive the device.
+		void SetImageLibrary(ImageLibrary* library) {
+			image_library_ = library;
+		}
+
+		// Passes a button or page event of the device to the worker. Doesn't wait for it, so the dispatcher thread
+		// isn't held up by a slow device.
+		void HandleEvent(const SdkEvent& event);
+
+		void* GetHandle() {
+			return handle_;
+		}
+
 		DeviceType GetType() {
-			return type_;
+			return caps_.type;
+		}
+
+		// Stops the SDK worker, dropping what's queued for it. Returns false if the worker is stuck in the library:
+		// a task of it may still use the device, which must not be destroyed then. Derived classes call it from
+		// their destructor too, as Recover() on the worker may still be running otherwise while they're destroyed.
+		bool StopExecutor() {
+			return executor_.Stop();
+		}
+
+		// Set by the DeviceRegistry before the device is published, 0 until then.
+		void SetId(const DeviceId id) {
+			id_ = id;
+		}
+
+		DeviceId GetId() {
+			return id_;
+		}
+
+		// Returns how many operations of the device are queued ahead of one in `lane`; see DeviceExecutor.
+		size_t GetQueueDepth(const WriteLane lane) {
+			return executor_.GetQueueDepth(lane);
+		}
+
+		// What the device can show, for validating requests before they reach the device.
+		const DeviceCaps& GetCaps() const {
+			return caps_;
 		}
 
 		std::wstring GetInfo();
+	protected:
+		// Writes the lines or the image of the page in the slot. Devices without a display write nothing.
+		virtual HRESULT WriteContent(DWORD slot, const PageData& data) {
+			return S_OK;
+		}
+
+		// Writes one line of the page in the slot.
+		virtual HRESULT WriteLine(DWORD slot, LineIndex line, const std::wstring& content) {
+			return S_OK;
+		}
+
+		// What the write methods accept, answered by the device type.
+		virtual bool HasLine(LineIndex line) const = 0;
+		virtual bool HasColumn(DWORD column) const = 0;
+		virtual bool HasLed(DWORD index) const = 0;
+		virtual bool HasImage() const = 0;
+
+
+		HRESULT SdkSetString(DWORD slot, LineIndex line, std::wstring content);
+
+		// Displays the image in the slot, from a device file if one has it, saving it to a new one otherwise.
+		HRESULT DisplayImage(DWORD slot, const std::string& image);
 	private:
+		// Writes the page shown on the device.
 		HRESULT UpdatePage();
 
-		static void __stdcall PageCallback(void* handle, DWORD page, bool activated, void* param) {
-			DirectOutputDevice* device = (DirectOutputDevice*)param;
-			device->HandlePageCallback(page, activated);
-		}
+		// Writes the page, if it's shown on the device.
+		HRESULT UpdatePage(DWORD page);
 
-		static void __stdcall ButtonCallback(void* handle, DWORD buttons, void* param) {
-			DirectOutputDevice* device = (DirectOutputDevice*)param;
-			device->HandleButtonCallback(buttons);
-		}
+		// Writes the lines of the page which differ from what the device shows, if the page is shown.
+		HRESULT FlushLines(DWORD page);
+
+		// Returns the page shown on the device.
+		std::optional<DWORD> GetShownPage();
+
+		// Marks the page as most recently used.
+		void Touch(DWORD page);
+
+		// Orders pages by how much they deserve a slot.
+		std::pair<int64_t, uint64_t> GetResidencyRank(DWORD page);
+
+		// Gives the page a slot if there's a free one, or if it outranks the lowest ranked resident page.
+		// Leaves the page virtual otherwise, or if writing it to the device fails.
+		HRESULT MakeResident(DWORD page, bool activate);
+
+		// Returns an unused slot, which may not be added to the device yet.
+		std::optional<DWORD> FindFreeSlot();
+
+		// Returns the resident page which would be evicted first. The shown page and pinned pages are never evicted.
+		std::optional<DWORD> FindEvictionCandidate();
+
+		// Returns the virtual page which would be swapped in first.
+		std::optional<DWORD> FindSwapInCandidate();
+
+		// What readers see of the device.
+		struct Snapshot {
+			PagesData pages;
+			std::map<DWORD, PageVersion> versions;
+			std::optional<DWORD> shown;
+
+			PageVersion GetVersion(const DWORD page) const {
+				auto it = versions.find(page);
+				return it == versions.end() ? 0 : it->second;
+			}
+		};
+
+		// Runs a write as a task on the worker, under the device lock, and reports the version it left through
+		// `version`.
+		HRESULT RunWrite(std::function<HRESULT(PageVersion* version)> write, PageVersion* version = nullptr);
+
+		// Ends a task which may have changed the pages: publishes the snapshot, then releases `lock`, the device
+		// lock, and sends the state events of the task.
+		void EndTask(std::unique_lock<std::mutex>& lock);
+
+		// Runs an SDK call through the executor. Requires the device lock, which is released while the call runs.
+		HRESULT RunSdkCall(std::function<HRESULT()> call);
+
+		// SDK calls made through the executor. The arguments are copied, as a call may outlive its caller and the
+		// device.
+		HRESULT SdkAddPage(DWORD slot, std::wstring name, DWORD flags);
+		HRESULT SdkRemovePage(DWORD slot);
+		HRESULT SdkSetLed(DWORD slot, DWORD index, DWORD value);
+		// Holds on to `image`, so its file stays while the call runs.
+		HRESULT SdkSaveFile(DWORD slot, DWORD file, LibraryImage image);
+		HRESULT SdkDisplayFile(DWORD slot, DWORD file);
+		HRESULT SdkDeleteFile(DWORD slot, DWORD file);
+
+		// Returns a free device file, deleting the least recently used one if there is none.
+		DWORD AllocateFile();
+
+		// Probes the device, then adds the resident pages again and rewrites the shown one. Run by the executor
+		// when the device may have lost its state. The SDK calls are made without the device lock, from a copy of
+		// what to write.
+		HRESULT Recover();
+
+		// Checks `if_match` against the version of the page. The caller holds the device lock until it committed the
+		// version, so that of two writes with the same `if_match` only one succeeds.
+		HRESULT CheckVersion(DWORD page, std::optional<PageVersion> if_match);
+
+		// Like GetPageVersion(). Requires the device lock.
+		PageVersion CurrentVersion(DWORD page);
+
+		// Bumps the version of the page if the write changed it, and reports the version through `version`. Called
+		// once the write reached the device.
+		void CommitVersion(DWORD page, bool changed, PageVersion* version);
+
+		// Undoes a write which failed to reach the device, and returns its `result`.
+		HRESULT RestorePage(DWORD page, const PageData& previous, HRESULT result);
+
+		// Queues a state event, sent by EndTask().
+		void PublishState(StateEvent event);
+
+		// Publishes the lines of the page which differ from `previous`, or all non-empty lines without it.
+		void PublishLines(DWORD page, const PageData* previous);
+
+		// Run on the SDK thread, with the SdkEventDispatcher as `param`. They only queue the event.
+		static void __stdcall PageCallback(void* handle, DWORD page, bool activated, void* param);
+
+		static void __stdcall ButtonCallback(void* handle, DWORD buttons, void* param);
 
 		// Handles page callback (page getting activated or deactivated).
 		void HandlePageCallback(const DWORD page, const bool activated);
@@ -61,11 +299,53 @@ namespace direct_output_proxy {
 
 		CDirectOutput* direct_output_ = nullptr;
 		void* handle_ = nullptr;
-		DeviceType type_ = DeviceType::kUnknown;
+		SdkEventDispatcher* events_ = nullptr;
+		const DeviceCaps& caps_;
+
+		// Guards everything below. Tasks on the worker change it; readers only hold it briefly.
+		std::mutex mutex_;
 		DWORD buttons_ = 0;
+		// The shown slot.
 		std::optional<DWORD> current_page_;
 
 		PagesData pages_;
+		RegionCompositor regions_;
+		// The composited lines last written to the shown page, unset if unknown.
+		std::optional<std::array<std::wstring, kBottomLine + 1>> shown_lines_;
+		// The page in each slot. Slots without a page are not added to the device.
+		std::vector<std::optional<DWORD>> slots_;
+		std::map<DWORD, DWORD> slot_of_;
+		std::map<DWORD, uint64_t> last_used_;
+		uint64_t use_clock_ = 0;
+		// Kept after a page is removed, so a re-added page continues from its last version.
+		std::map<DWORD, PageVersion> versions_;
+		std::atomic<DeviceId> id_ = 0;
+		// Sent after the snapshot which has their change, so a client which fetched a snapshot before an event was
+		// numbered finds its change in the snapshot.
+		std::vector<StateEvent> pending_state_;
+		std::atomic<std::shared_ptr<const Snapshot>> snapshot_{ std::make_shared<const Snapshot>() };
 		ButtonEventCallback button_callback_;
+		StateEventCallback state_callback_;
+		TrafficRecorder* recorder_ = nullptr;
+
+		// An image saved on a page of the device. The file belongs to that page: it's only displayed and deleted
+		// there, and goes when the page is removed from the device. A file is found by the slot, the image and its
+		// version, so a page showing the image again reuses it, as does a page swapped into the slot.
+		struct DeviceFile {
+			DWORD slot = 0;
+			std::string image;
+			uint64_t image_version = 0;
+			uint64_t last_used = 0;
+		};
+
+		ImageLibrary* image_library_ = nullptr;
+		std::vector<std::optional<DeviceFile>> files_ = std::vector<std::optional<DeviceFile>>(kMaxDeviceFiles);
+		uint64_t image_hits_ = 0;
+		uint64_t image_misses_ = 0;
+		uint64_t image_evictions_ = 0;
+
+		// Last, so it's destroyed first, before the members its calls use. By then the derived class is gone
+		// already, so TypedDevice stops it earlier, in its destructor.
+		DeviceExecutor executor_;
 	};
 }
@@ -5,7 +5,10 @@
 
 namespace direct_output_proxy {
 
-	CDirectOutput::CDirectOutput() :
+	CDirectOutput::CDirectOutput() : CDirectOutput(true)
+	{
+	}
+	CDirectOutput::CDirectOutput(bool load_library) :
 		m_module(NULL),
 		m_initialize(0), m_deinitialize(0),
 		m_registerdevicecallback(0), m_enumerate(0),
@@ -14,8 +17,9 @@ namespace direct_output_proxy {
 		m_setprofile(0), m_addpage(0), m_removepage(0),
 		m_setled(0), m_setstring(0), m_setimage(0), m_setimagefromfile(0),
 		m_startserver(0), m_closeserver(0), m_sendservermsg(0), m_sendserverfile(0),
-		m_savefile(0), m_displayfile(0), m_deletefile(0)
+		m_savefile(0), m_displayfile(0), m_deletefile(0), m_getserialnumber(0)
 	{
+		if (!load_library) return;
 		TCHAR filename[2048] = { 0 };
 		if (GetDirectOutputFilename(filename, sizeof(filename) / sizeof(filename[0])))
 		{
@@ -61,7 +65,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::Initialize(const wchar_t* wszPluginName)
 	{
-		if (m_module && m_initialize)
+		if (m_initialize)
 		{
 			return m_initialize(wszPluginName);
 		}
@@ -69,7 +73,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::Deinitialize()
 	{
-		if (m_module && m_deinitialize)
+		if (m_deinitialize)
 		{
 			return m_deinitialize();
 		}
@@ -77,7 +81,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::RegisterDeviceCallback(Pfn_DirectOutput_DeviceChange pfnCb, void* pCtxt)
 	{
-		if (m_module && m_registerdevicecallback)
+		if (m_registerdevicecallback)
 		{
 			return m_registerdevicecallback(pfnCb, pCtxt);
 		}
@@ -85,7 +89,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::Enumerate(Pfn_DirectOutput_EnumerateCallback pfnCb, void* pCtxt)
 	{
-		if (m_module && m_enumerate)
+		if (m_enumerate)
 		{
 			return m_enumerate(pfnCb, pCtxt);
 		}
@@ -93,7 +97,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::RegisterPageCallback(void* hDevice, Pfn_DirectOutput_PageChange pfnCb, void* pCtxt)
 	{
-		if (m_module && m_registerpagecallback)
+		if (m_registerpagecallback)
 		{
 			return m_registerpagecallback(hDevice, pfnCb, pCtxt);
 		}
@@ -101,7 +105,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::RegisterSoftButtonCallback(void* hDevice, Pfn_DirectOutput_SoftButtonChange pfnCb, void* pCtxt)
 	{
-		if (m_module && m_registersoftbuttoncallback)
+		if (m_registersoftbuttoncallback)
 		{
 			return m_registersoftbuttoncallback(hDevice, pfnCb, pCtxt);
 		}
@@ -109,7 +113,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::GetDeviceType(void* hDevice, LPGUID pGuid)
 	{
-		if (m_module && m_getdevicetype)
+		if (m_getdevicetype)
 		{
 			return m_getdevicetype(hDevice, pGuid);
 		}
@@ -117,7 +121,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::GetDeviceInstance(void* hDevice, LPGUID pGuid)
 	{
-		if (m_module && m_getdeviceinstance)
+		if (m_getdeviceinstance)
 		{
 			return m_getdeviceinstance(hDevice, pGuid);
 		}
@@ -125,7 +129,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::SetProfile(void* hDevice, DWORD cchProfile, const wchar_t* wszProfile)
 	{
-		if (m_module && m_setprofile)
+		if (m_setprofile)
 		{
 			return m_setprofile(hDevice, cchProfile, wszProfile);
 		}
@@ -133,7 +137,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::AddPage(void* hDevice, DWORD dwPage, const wchar_t* wszDebugName, DWORD dwFlags)
 	{
-		if (m_module && m_addpage)
+		if (m_addpage)
 		{
 			return m_addpage(hDevice, dwPage, dwFlags);
 		}
@@ -141,7 +145,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::RemovePage(void* hDevice, DWORD dwPage)
 	{
-		if (m_module && m_removepage)
+		if (m_removepage)
 		{
 			return m_removepage(hDevice, dwPage);
 		}
@@ -149,7 +153,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::SetLed(void* hDevice, DWORD dwPage, DWORD dwIndex, DWORD dwValue)
 	{
-		if (m_module && m_setled)
+		if (m_setled)
 		{
 			return m_setled(hDevice, dwPage, dwIndex, dwValue);
 		}
@@ -157,7 +161,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::SetString(void* hDevice, DWORD dwPage, DWORD dwIndex, DWORD cchValue, const wchar_t* wszValue)
 	{
-		if (m_module && m_setstring)
+		if (m_setstring)
 		{
 			return m_setstring(hDevice, dwPage, dwIndex, cchValue, wszValue);
 		}
@@ -165,7 +169,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::SetImage(void* hDevice, DWORD dwPage, DWORD dwIndex, DWORD cbValue, const void* pvValue)
 	{
-		if (m_module && m_setimage)
+		if (m_setimage)
 		{
 			return m_setimage(hDevice, dwPage, dwIndex, cbValue, pvValue);
 		}
@@ -173,7 +177,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::SetImageFromFile(void* hDevice, DWORD dwPage, DWORD dwIndex, DWORD cchFilename, const wchar_t* wszFilename)
 	{
-		if (m_module && m_setimagefromfile)
+		if (m_setimagefromfile)
 		{
 			return m_setimagefromfile(hDevice, dwPage, dwIndex, cchFilename, wszFilename);
 		}
@@ -181,7 +185,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::StartServer(void* hDevice, DWORD cchFilename, const wchar_t* wszFilename, LPDWORD pdwServerId, PSRequestStatus psStatus)
 	{
-		if (m_module && m_startserver)
+		if (m_startserver)
 		{
 			return m_startserver(hDevice, cchFilename, wszFilename, pdwServerId, psStatus);
 		}
@@ -189,7 +193,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::CloseServer(void* hDevice, DWORD dwServerId, PSRequestStatus psStatus)
 	{
-		if (m_module && m_closeserver)
+		if (m_closeserver)
 		{
 			return m_closeserver(hDevice, dwServerId, psStatus);
 		}
@@ -197,7 +201,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::SendServerMsg(void* hDevice, DWORD dwServerId, DWORD dwRequest, DWORD dwPage, DWORD cbIn, const void* pvIn, DWORD cbOut, void* pvOut, PSRequestStatus psStatus)
 	{
-		if (m_module && m_sendservermsg)
+		if (m_sendservermsg)
 		{
 			return m_sendservermsg(hDevice, dwServerId, dwRequest, dwPage, cbIn, pvIn, cbOut, pvOut, psStatus);
 		}
@@ -205,7 +209,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::SendServerFile(void* hDevice, DWORD dwServerId, DWORD dwRequest, DWORD dwPage, DWORD cbInHdr, const void* pvInHdr, DWORD cchFile, const wchar_t* wszFile, DWORD cbOut, void* pvOut, PSRequestStatus psStatus)
 	{
-		if (m_module && m_sendserverfile)
+		if (m_sendserverfile)
 		{
 			return m_sendserverfile(hDevice, dwServerId, dwRequest, dwPage, cbInHdr, pvInHdr, cchFile, wszFile, cbOut, pvOut, psStatus);
 		}
@@ -213,7 +217,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::SaveFile(void* hDevice, DWORD dwPage, DWORD dwFile, DWORD cchFilename, const wchar_t* wszFilename, PSRequestStatus psStatus)
 	{
-		if (m_module && m_savefile)
+		if (m_savefile)
 		{
 			return m_savefile(hDevice, dwPage, dwFile, cchFilename, wszFilename, psStatus);
 		}
@@ -221,7 +225,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::DisplayFile(void* hDevice, DWORD dwPage, DWORD dwIndex, DWORD dwFile, PSRequestStatus psStatus)
 	{
-		if (m_module && m_displayfile)
+		if (m_displayfile)
 		{
 			return m_displayfile(hDevice, dwPage, dwIndex, dwFile, psStatus);
 		}
@@ -229,7 +233,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::DeleteFile(void* hDevice, DWORD dwPage, DWORD dwFile, PSRequestStatus psStatus)
 	{
-		if (m_module && m_deletefile)
+		if (m_deletefile)
 		{
 			return m_deletefile(hDevice, dwPage, dwFile, psStatus);
 		}
@@ -237,7 +241,7 @@ namespace direct_output_proxy {
 	}
 	HRESULT CDirectOutput::GetSerialNumber(void* hDevice, wchar_t* pszSerialNumber, DWORD dwSize)
 	{
-		if (m_module && m_getserialnumber)
+		if (m_getserialnumber)
 		{
 			return m_getserialnumber(hDevice, pszSerialNumber, dwSize);
 		}
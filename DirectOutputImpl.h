@@ -12,6 +12,8 @@ namespace direct_output_proxy {
 	{
 	public:
 		CDirectOutput();
+		// Without loading the library, all calls fail with E_NOTIMPL until FakeDirectOutput provides them.
+		explicit CDirectOutput(bool load_library);
 		~CDirectOutput();
 
 		HRESULT Initialize(const wchar_t* wszPluginName);
@@ -38,6 +40,8 @@ namespace direct_output_proxy {
 		HRESULT DeleteFile(void* hDevice, DWORD dwPage, DWORD dwFile, PSRequestStatus psStatus);
 		HRESULT GetSerialNumber(void* hDevice, wchar_t* pszSerialNumber, DWORD dwSize);
 	private:
+		friend class FakeDirectOutput;
+
 		HMODULE										m_module;
 
 		Pfn_DirectOutput_Initialize					m_initialize;
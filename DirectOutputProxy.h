@@ -1,11 +1,20 @@
 #include <map>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <thread>
 #include <utility>
 
 #include <Windows.h>
 
 #include "DirectOutputImpl.h"
 #include "DirectOutputDevice.h"
+#include "DeviceRegistry.h"
+#include "FakeDirectOutput.h"
+#include "RegionCompositor.h"
+#include "SdkEventDispatcher.h"
+#include "TrafficLog.h"
+#include "TypedDevice.h"
 #include "utils.h"
 #include "types.h"
 
@@ -14,7 +23,21 @@ namespace direct_output_proxy {
 
 	class DirectOutputProxy {
 	public:
+		// With `fake_sdk`, FakeDirectOutput is used instead of the DirectOutput library.
+		explicit DirectOutputProxy(const bool fake_sdk = false)
+			: direct_output_(/*load_library=*/!fake_sdk), events_([this](const SdkEvent& event) { HandleSdkEvent(event); }) {
+			if (fake_sdk) FakeDirectOutput::Install(direct_output_);
+		}
+
+		~DirectOutputProxy() {
+			StopRegionExpiry();
+		}
+
 		bool Init() {
+			events_.Start();
+			// Regions expire without client traffic, and removed devices are destroyed once unused, so something
+			// has to check them.
+			region_expiry_ = std::thread([this]() { ExpireRegionsLoop(); });
 			HRESULT status = direct_output_.Initialize(L"DirectOutputProxy");
 			if (FAILED(status)) {
 				if (status == E_NOTIMPL) {
@@ -30,6 +53,8 @@ namespace direct_output_proxy {
 		}
 
 		bool Shutdown() {
+			StopRegionExpiry();
+			events_.Stop();
 			HRESULT status = direct_output_.Deinitialize();
 			if (FAILED(status)) {
 				CHECK_ERROR("deinitialize", status);
@@ -38,17 +63,31 @@ namespace direct_output_proxy {
 			return true;
 		}
 
-		DirectOutputDevice* GetDeviceByType(const DeviceType dev_type) {
-			for (auto& [handle, device] : devices_) {
-				if (device.GetType() == dev_type) return &device;
-			}
-			return nullptr;
+		// The device stays usable while the reference is held, even if it's detached meanwhile.
+		DeviceRef GetDeviceByType(const DeviceType dev_type) {
+			return devices_.Find([dev_type](DirectOutputDevice& device) { return device.GetType() == dev_type; });
+		}
+
+		DeviceRef GetDevice(const DeviceHandle handle) {
+			return devices_.Get(handle);
 		}
 
 		void ApplyToDevices(DeviceCallback callback) {
-			for (auto& [handle, device] : devices_) {
-				callback(device);
-			}
+			devices_.ForEach(callback);
+		}
+
+		std::string GetEventInfo() {
+			return events_.GetInfo();
+		}
+
+		// Records the device callbacks. Must be called before Init(). `recorder` must outlive the proxy.
+		void SetRecorder(TrafficRecorder* recorder) {
+			recorder_ = recorder;
+		}
+
+		// Gives the devices the images to show. Must be called before Init(). `library` must outlive the proxy.
+		void SetImageLibrary(ImageLibrary* library) {
+			image_library_ = library;
 		}
 
 		void RegisterNewDeviceCallback(DeviceCallback callback) {
@@ -58,8 +97,36 @@ namespace direct_output_proxy {
 		void RegisterDeviceGoneCallback(DeviceCallback callback) {
 			device_gone_cb_ = std::move(callback);
 		}
+
+		// Registers a callback for the state changes of all devices, including attaching and detaching them.
+		// Must be called before Init().
+		void RegisterStateCallback(StateEventCallback callback) {
+			state_cb_ = std::move(callback);
+		}
 	private:
+		void ExpireRegionsLoop() {
+			std::unique_lock lock(region_expiry_mutex_);
+			while (!region_expiry_cv_.wait_for(lock, kRegionExpiryInterval, [this]() { return stop_region_expiry_; })) {
+				lock.unlock();
+				const auto now = std::chrono::steady_clock::now();
+				devices_.ForEach([now](DirectOutputDevice& device) { device.ExpireRegions(now); });
+				devices_.Reclaim();
+				lock.lock();
+			}
+		}
+
+		void StopRegionExpiry() {
+			if (!region_expiry_.joinable()) return;
+			{
+				std::lock_guard lock(region_expiry_mutex_);
+				stop_region_expiry_ = true;
+			}
+			region_expiry_cv_.notify_all();
+			region_expiry_.join();
+		}
+
 		static void __stdcall EnumerateCallback(void* device, void* param) {
+			SdkCallbackScope scope;
 			DirectOutputProxy* proxy = (DirectOutputProxy*)param;
 			proxy->HandleNewDevice(device);
 		}
@@ -67,16 +134,47 @@ namespace direct_output_proxy {
 		void HandleNewDevice(void* handle) {
 			Debug() << "device: " << handle << std::endl;
 
-			devices_.insert(std::make_pair(handle, DirectOutputDevice(&direct_output_, handle)));
-
-			DirectOutputDevice& device = devices_.at(handle);
-			device.Init();
-			if (new_device_cb_) new_device_cb_(device);
+			// The type decides which implementation handles the device. Devices which don't tell are kUnknown.
+			GUID guid;
+			DeviceType type = DeviceType::kUnknown;
+			if (SUCCEEDED(CHECK_ERROR("GetDeviceType", direct_output_.GetDeviceType(handle, &guid)))) {
+				type = DeviceTypeGuidToDeviceType(guid);
+			}
+			std::unique_ptr<DirectOutputDevice> device = MakeDevice(type, &direct_output_, handle, &events_);
+			device->SetRecorder(recorder_);
+			device->SetImageLibrary(image_library_);
+			device->RegisterStateCallback(state_cb_);
+			device->Init();
+			if (recorder_ != nullptr) recorder_->RecordDevice(type, true);
+
+			// Added before the callback sets it up, so state snapshots have the device before its pages are published.
+			std::optional<DeviceHandle> added = devices_.Add(handle, std::move(device));
+			if (!added.has_value()) return;
+			if (state_cb_) state_cb_({ .device = type, .device_id = added->id(), .change = StateChange::kDeviceAdded });
+			DeviceRef ref = devices_.Get(added.value());
+			if (ref && new_device_cb_) new_device_cb_(*ref);
 		}
 
+		// Run on the SDK thread. Only queues the event.
 		static void __stdcall RawDeviceCallback(void* device, bool added, void* param) {
 			DirectOutputProxy* proxy = (DirectOutputProxy*)param;
-			proxy->HandleDeviceCallback(device, added);
+			proxy->events_.Push({ .type = added ? SdkEventType::kDeviceAdded : SdkEventType::kDeviceRemoved, .device = device,
+				.time = std::chrono::steady_clock::now() });
+		}
+
+		// Handles the SDK callbacks on the dispatcher thread, in order.
+		void HandleSdkEvent(const SdkEvent& event) {
+			switch (event.type) {
+			case SdkEventType::kDeviceAdded:
+			case SdkEventType::kDeviceRemoved:
+				HandleDeviceCallback(event.device, event.type == SdkEventType::kDeviceAdded);
+				break;
+			default: {
+				DeviceRef device = devices_.Find([&event](DirectOutputDevice& device) { return device.GetHandle() == event.device; });
+				if (device) device->HandleEvent(event);
+				break;
+			}
+			}
 		}
 
 		void HandleDeviceCallback(void* device, bool added) {
@@ -85,14 +183,29 @@ namespace direct_output_proxy {
 			if (added) {
 				HandleNewDevice(device);
 			} else {
-				if (device_gone_cb_ && devices_.contains(device)) device_gone_cb_(devices_.at(device));
-				devices_.erase(device);
+				// The reference keeps the device alive for the callbacks; it's destroyed later by Reclaim().
+				DeviceRef gone = devices_.Find([device](DirectOutputDevice& candidate) { return candidate.GetHandle() == device; });
+				if (!gone || !devices_.Remove(device)) return;
+				if (recorder_ != nullptr) recorder_->RecordDevice(gone->GetType(), false);
+				if (state_cb_) {
+					state_cb_({ .device = gone->GetType(), .device_id = gone.handle().id(), .change = StateChange::kDeviceRemoved });
+				}
+				if (device_gone_cb_) device_gone_cb_(*gone);
 			}
 		}
 
 		CDirectOutput direct_output_;
-		std::map<void*, DirectOutputDevice> devices_;
+		DeviceRegistry devices_;
+		SdkEventDispatcher events_;
 
 		DeviceCallback new_device_cb_, device_gone_cb_;
+		StateEventCallback state_cb_;
+		TrafficRecorder* recorder_ = nullptr;
+		ImageLibrary* image_library_ = nullptr;
+
+		std::thread region_expiry_;
+		std::mutex region_expiry_mutex_;
+		std::condition_variable region_expiry_cv_;
+		bool stop_region_expiry_ = false;
 	};
 }
@@ -0,0 +1,317 @@
+#include "EventSubscriptions.h"
+
+#include <bit>
+#include <format>
+#include <sstream>
+#include <string>
+
+#include <Windows.h>
+#include "types.h"
+#include "utils.h"
+
+namespace direct_output_proxy {
+	namespace {
+		std::vector<std::string> SplitList(const std::string& value) {
+			std::vector<std::string> items;
+			std::stringstream ss(value);
+			std::string item;
+			while (std::getline(ss, item, ',')) {
+				if (!item.empty()) items.push_back(item);
+			}
+			return items;
+		}
+
+		size_t PageBucket(const DWORD page) {
+			return page < kIndexedPages ? page : kIndexedPages - 1;
+		}
+
+		size_t KindOf(const ButtonEvent& event) {
+			return static_cast<size_t>(event.down ? EventKind::kButtonDown : EventKind::kButtonUp);
+		}
+
+		std::string Encode(const ButtonEvent& event, const EventEncoding encoding) {
+			std::string button = WstrToStrOrDie(ButtonToString(event.device, event.button));
+			switch (encoding) {
+			case EventEncoding::kJson:
+				return std::format(R"({{"device":"{}","button":"{}","down":{},"page":{}}})",
+					DevTypeToId(event.device), button, event.down, event.page);
+			case EventEncoding::kText:
+			default:
+				return std::format("{} {} {}", button, event.down, event.page);
+			}
+		}
+
+		const char* StateChangeToString(const StateChange change) {
+			switch (change) {
+			case StateChange::kDeviceAdded:
+				return "device_added";
+			case StateChange::kDeviceRemoved:
+				return "device_removed";
+			case StateChange::kPageAdded:
+				return "page_added";
+			case StateChange::kPageRemoved:
+				return "page_removed";
+			case StateChange::kPageActivated:
+				return "page_activated";
+			case StateChange::kPageDeactivated:
+				return "page_deactivated";
+			case StateChange::kLine:
+			default:
+				return "line";
+			}
+		}
+
+		// Text is "state <sequence> <change> <device> <device id> <page> <line> <version> <text>", the text being last
+		// as it may contain spaces.
+		std::string Encode(const StateEvent& event, const uint64_t sequence, const EventEncoding encoding) {
+			const std::string text = WstrToStr(event.text).value_or("");
+			switch (encoding) {
+			case EventEncoding::kJson: {
+				std::string json = std::format(R"({{"seq":{},"change":"{}","device":"{}","id":{},"page":{},"line":{},"version":{},"text":)",
+					sequence, StateChangeToString(event.change), DevTypeToId(event.device), event.device_id, event.page,
+					static_cast<int>(event.line), event.version);
+				AppendJsonString(json, text);
+				json += '}';
+				return json;
+			}
+			case EventEncoding::kText:
+			default:
+				return std::format("state {} {} {} {} {} {} {} {}", sequence, StateChangeToString(event.change),
+					DevTypeToId(event.device), event.device_id, event.page, static_cast<int>(event.line), event.version, text);
+			}
+		}
+
+		// Splits a message like "filter pages=0,1 kinds=down" into its key=value params.
+		std::map<std::string, std::string> ParseMessageParams(const std::string& message) {
+			std::map<std::string, std::string> params;
+			std::stringstream ss(message);
+			std::string token;
+			ss >> token;  // command
+			while (ss >> token) {
+				size_t eq = token.find('=');
+				if (eq == std::string::npos) {
+					params[token] = "";
+				} else {
+					params[token.substr(0, eq)] = token.substr(eq + 1);
+				}
+			}
+			return params;
+		}
+	}
+
+	std::optional<std::string> ParseEventFilter(const std::map<std::string, std::string>& params, EventFilter* filter) {
+		EventFilter result;
+		for (const auto& [key, value] : params) {
+			// An empty list would match nothing, which is never what a client means.
+			if (SplitList(value).empty()) return "invalid param: " + key;
+			if (value == "all") {
+				if (key == "kinds") result.kinds = ~0u;
+				continue;
+			}
+			if (key == "device") {
+				result.devices = 0;
+				for (const std::string& item : SplitList(value)) {
+					std::optional<DeviceType> type = DevTypeFromId(item);
+					if (!type.has_value()) return "invalid device: " + item;
+					result.devices |= 1u << static_cast<int>(type.value());
+				}
+			} else if (key == "pages") {
+				result.pages = 0;
+				for (const std::string& item : SplitList(value)) {
+					try {
+						result.pages |= 1ull << PageBucket(std::stoul(item));
+					} catch (const std::exception&) {
+						return "invalid page: " + item;
+					}
+				}
+			} else if (key == "buttons") {
+				result.buttons.fill(0);
+				for (const std::string& item : SplitList(value)) {
+					bool found = false;
+					for (size_t type = 0; type < kDeviceTypes; ++type) {
+						std::optional<DWORD> button = StringToButton(static_cast<DeviceType>(type), item);
+						if (!button.has_value()) continue;
+						result.buttons[type] |= button.value();
+						found = true;
+					}
+					if (!found) return "invalid button: " + item;
+				}
+			} else if (key == "kinds") {
+				result.kinds = 0;
+				for (const std::string& item : SplitList(value)) {
+					if (item == "down") {
+						result.kinds |= 1u << static_cast<int>(EventKind::kButtonDown);
+					} else if (item == "up") {
+						result.kinds |= 1u << static_cast<int>(EventKind::kButtonUp);
+					} else if (item == "state") {
+						result.kinds |= 1u << static_cast<int>(EventKind::kState);
+					} else {
+						return "invalid kind: " + item;
+					}
+				}
+			} else if (key == "encoding") {
+				if (value == "text") {
+					result.encoding = EventEncoding::kText;
+				} else if (value == "json") {
+					result.encoding = EventEncoding::kJson;
+				} else {
+					return "invalid encoding: " + value;
+				}
+			} else {
+				return "unknown param: " + key;
+			}
+		}
+		*filter = result;
+		return std::nullopt;
+	}
+
+	std::optional<std::string> ParseFilterMessage(const std::string& message, EventFilter* filter) {
+		if (!message.starts_with("filter")) return "unknown command";
+		return ParseEventFilter(ParseMessageParams(message), filter);
+	}
+
+	void EventSubscriptions::Send(const Receivers& receivers, const std::function<std::string(EventEncoding)>& encode) {
+		std::optional<std::string> encoded[kEncodings];
+		for (const auto& [subscriber, encoding] : receivers) {
+			std::optional<std::string>& msg = encoded[static_cast<size_t>(encoding)];
+			if (!msg.has_value()) msg = encode(encoding);
+			std::lock_guard lock(subscriber->mutex);
+			if (subscriber->conn != nullptr) subscriber->conn->send_text(msg.value());
+		}
+	}
+
+	size_t EventSubscriptions::AllocateSlot(Index& index) {
+		for (size_t slot = 0; slot < index.slots.size(); ++slot) {
+			if (index.slots[slot] == nullptr) return slot;
+		}
+
+		size_t slot = index.slots.size();
+		index.slots.push_back(nullptr);
+		index.filters.emplace_back();
+
+		const size_t words = (index.slots.size() + 63) / 64;
+		auto grow = [words](auto& masks) {
+			for (SlotMask& mask : masks) mask.resize(words, 0);
+		};
+		grow(index.devices);
+		grow(index.pages);
+		for (auto& device_buttons : index.buttons) grow(device_buttons);
+		grow(index.kinds);
+		return slot;
+	}
+
+	void EventSubscriptions::IndexSlot(Index& index, const size_t slot, const EventFilter& filter, const bool set) {
+		const size_t word = slot / 64;
+		const uint64_t bit = 1ull << (slot % 64);
+		auto apply = [word, bit, set](SlotMask& mask, const bool wanted) {
+			if (set && wanted) {
+				mask[word] |= bit;
+			} else {
+				mask[word] &= ~bit;
+			}
+		};
+
+		for (size_t i = 0; i < kDeviceTypes; ++i) apply(index.devices[i], (filter.devices >> i) & 1);
+		for (size_t i = 0; i < kIndexedPages; ++i) apply(index.pages[i], (filter.pages >> i) & 1);
+		for (size_t device = 0; device < kDeviceTypes; ++device) {
+			for (size_t i = 0; i < kButtonBits; ++i) apply(index.buttons[device][i], (filter.buttons[device] >> i) & 1);
+		}
+		for (size_t i = 0; i < kEventKinds; ++i) apply(index.kinds[i], (filter.kinds >> i) & 1);
+	}
+
+	void EventSubscriptions::Add(crow::websocket::connection* conn, const EventFilter& filter) {
+		std::lock_guard lock(mutex_);
+		if (slot_of_.contains(conn)) return;
+
+		auto index = std::make_shared<Index>(*index_.load());
+		size_t slot = AllocateSlot(*index);
+		index->slots[slot] = std::make_shared<Subscriber>();
+		index->slots[slot]->conn = conn;
+		index->filters[slot] = filter;
+		IndexSlot(*index, slot, filter, /*set=*/true);
+		slot_of_[conn] = slot;
+		index_.store(std::move(index));
+	}
+
+	void EventSubscriptions::Update(crow::websocket::connection* conn, const EventFilter& filter) {
+		std::lock_guard lock(mutex_);
+		auto it = slot_of_.find(conn);
+		if (it == slot_of_.end()) return;
+
+		auto index = std::make_shared<Index>(*index_.load());
+		index->filters[it->second] = filter;
+		IndexSlot(*index, it->second, filter, /*set=*/true);
+		index_.store(std::move(index));
+	}
+
+	void EventSubscriptions::Remove(crow::websocket::connection* conn) {
+		std::shared_ptr<Subscriber> subscriber;
+		{
+			std::lock_guard lock(mutex_);
+			auto it = slot_of_.find(conn);
+			if (it == slot_of_.end()) return;
+
+			auto index = std::make_shared<Index>(*index_.load());
+			IndexSlot(*index, it->second, index->filters[it->second], /*set=*/false);
+			subscriber = std::move(index->slots[it->second]);
+			slot_of_.erase(it);
+			index_.store(std::move(index));
+		}
+		// Publishers may still hold the previous index; clearing the connection makes them skip it. Waits for a
+		// send in progress.
+		std::lock_guard lock(subscriber->mutex);
+		subscriber->conn = nullptr;
+	}
+
+	void EventSubscriptions::Publish(const ButtonEvent& event) {
+		const size_t device = static_cast<size_t>(event.device);
+		const int button = std::countr_zero(static_cast<uint32_t>(event.button));
+		if (device >= kDeviceTypes || button >= static_cast<int>(kButtonBits)) return;
+
+		std::lock_guard publish_lock(publish_mutex_);
+		const std::shared_ptr<const Index> index = index_.load();
+		const SlotMask& devices = index->devices[device];
+		const SlotMask& pages = index->pages[PageBucket(event.page)];
+		const SlotMask& buttons = index->buttons[device][button];
+		const SlotMask& kinds = index->kinds[KindOf(event)];
+
+		Receivers receivers;
+		for (size_t word = 0; word < devices.size(); ++word) {
+			uint64_t matches = devices[word] & pages[word] & buttons[word] & kinds[word];
+			while (matches != 0) {
+				const size_t slot = word * 64 + std::countr_zero(matches);
+				matches &= matches - 1;
+				receivers.emplace_back(index->slots[slot], index->filters[slot].encoding);
+			}
+		}
+		Send(receivers, [&event](const EventEncoding encoding) { return Encode(event, encoding); });
+	}
+
+	void EventSubscriptions::PublishState(const StateEvent& event) {
+		const size_t device = static_cast<size_t>(event.device);
+		if (device >= kDeviceTypes) return;
+		const bool device_change = event.change == StateChange::kDeviceAdded || event.change == StateChange::kDeviceRemoved;
+
+		std::lock_guard publish_lock(publish_mutex_);
+		const uint64_t sequence = ++state_sequence_;
+		const std::shared_ptr<const Index> index = index_.load();
+		const SlotMask& devices = index->devices[device];
+		const SlotMask& pages = index->pages[PageBucket(event.page)];
+		const SlotMask& kinds = index->kinds[static_cast<size_t>(EventKind::kState)];
+
+		Receivers receivers;
+		for (size_t word = 0; word < devices.size(); ++word) {
+			uint64_t matches = devices[word] & kinds[word] & (device_change ? ~0ull : pages[word]);
+			while (matches != 0) {
+				const size_t slot = word * 64 + std::countr_zero(matches);
+				matches &= matches - 1;
+				receivers.emplace_back(index->slots[slot], index->filters[slot].encoding);
+			}
+		}
+		Send(receivers, [&event, sequence](const EventEncoding encoding) { return Encode(event, sequence, encoding); });
+	}
+
+	uint64_t EventSubscriptions::GetStateSequence() {
+		return state_sequence_;
+	}
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <crow/websocket.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <Windows.h>
+#include "types.h"
+
+namespace direct_output_proxy {
+	enum class EventKind {
+		kButtonDown,
+		kButtonUp,
+		// StateEvent deltas. Only sent to clients which ask for them.
+		kState,
+	};
+
+	enum class EventEncoding {
+		kText,
+		kJson,
+	};
+
+	struct ButtonEvent {
+		DeviceType device = DeviceType::kUnknown;
+		DWORD button = 0;
+		bool down = false;
+		DWORD page = 0;
+	};
+
+	// Pages below this are indexed one by one, the rest share the last bucket.
+	constexpr DWORD kIndexedPages = 64;
+
+	// What an /events client wants to receive. Each field is a bitmask, a set bit means the value is wanted.
+	struct EventFilter {
+		// One bit per DeviceType.
+		uint32_t devices = ~0u;
+		// One bit per page. Bit kIndexedPages - 1 covers that page and all pages after it.
+		uint64_t pages = ~0ull;
+		// Button bits of each DeviceType. Devices use the same bits for different buttons, e.g. the X52 Pro's Up is
+		// the FIP's RightCW, so each device type has its own mask.
+		std::array<DWORD, kDeviceTypes> buttons = { ~0ul, ~0ul, ~0ul };
+		// One bit per EventKind. State events are not sent unless asked for.
+		uint32_t kinds = (1u << static_cast<int>(EventKind::kButtonDown)) | (1u << static_cast<int>(EventKind::kButtonUp));
+		EventEncoding encoding = EventEncoding::kText;
+	};
+
+	// Parses a filter from params named device, pages, buttons, kinds and encoding.
+	// List values are comma separated, e.g. pages=0,1 buttons=Select,Up kinds=down. A button name selects the
+	// button of that name on every device type which has one.
+	// Params which are missing match everything. Returns an error message if a param is invalid.
+	std::optional<std::string> ParseEventFilter(const std::map<std::string, std::string>& params, EventFilter* filter);
+
+	// Parses a message like "filter pages=0,1 kinds=down", sent by /events clients to change their filter.
+	// Returns an error message if it's not a filter message, or if a param is invalid.
+	std::optional<std::string> ParseFilterMessage(const std::string& message, EventFilter* filter);
+
+	// Keeps the /events connections and their filters.
+	// The filters are stored as an inverted bitmask index (value -> set of connections), so finding the
+	// receivers of an event is a few ANDs per 64 connections. Connecting, changing a filter and disconnecting
+	// replace the index as a whole, so publishing reads it without locking, and they don't wait for sends.
+	class EventSubscriptions {
+	public:
+		void Add(crow::websocket::connection* conn, const EventFilter& filter);
+
+		// Replaces the filter of an existing connection.
+		void Update(crow::websocket::connection* conn, const EventFilter& filter);
+
+		// Nothing is sent to the connection once this returns.
+		void Remove(crow::websocket::connection* conn);
+
+		// Sends the event to the matching connections. The event is encoded at most once per encoding, and only
+		// for encodings that have a receiver.
+		void Publish(const ButtonEvent& event);
+
+		// Numbers the state change and sends it to the connections which want state events of the device and
+		// the page. Device changes ignore the page filter.
+		void PublishState(const StateEvent& event);
+
+		// The number of the last state change. A client which fetched a snapshot at sequence N stays in sync by
+		// applying the state events numbered above N.
+		uint64_t GetStateSequence();
+	private:
+		using SlotMask = std::vector<uint64_t>;
+
+		// A connection, which is cleared when it's removed, so a send racing with the removal is skipped.
+		struct Subscriber {
+			std::mutex mutex;
+			crow::websocket::connection* conn = nullptr;
+		};
+
+		using Receivers = std::vector<std::pair<std::shared_ptr<Subscriber>, EventEncoding>>;
+
+		// Sends each receiver the message in its encoding. `encode` is called at most once per encoding.
+		static void Send(const Receivers& receivers, const std::function<std::string(EventEncoding)>& encode);
+
+		static constexpr size_t kButtonBits = 32;
+		static constexpr size_t kEventKinds = 3;
+		static constexpr size_t kEncodings = 2;
+
+		struct Index {
+			// Subscriber in each slot, nullptr for free slots.
+			std::vector<std::shared_ptr<Subscriber>> slots;
+			std::vector<EventFilter> filters;
+
+			std::array<SlotMask, kDeviceTypes> devices;
+			std::array<SlotMask, kIndexedPages> pages;
+			// Indexed by device type, then button bit.
+			std::array<std::array<SlotMask, kButtonBits>, kDeviceTypes> buttons;
+			std::array<SlotMask, kEventKinds> kinds;
+		};
+
+		// Sets or clears the bits of `slot` in every index entry matched by `filter`.
+		static void IndexSlot(Index& index, size_t slot, const EventFilter& filter, bool set);
+
+		static size_t AllocateSlot(Index& index);
+
+		// Held while publishing, so every connection receives the events in the order they were published.
+		std::mutex publish_mutex_;
+		// Held while changing the index.
+		std::mutex mutex_;
+		std::map<crow::websocket::connection*, size_t> slot_of_;
+		std::atomic<std::shared_ptr<const Index>> index_{ std::make_shared<const Index>() };
+
+		std::atomic<uint64_t> state_sequence_ = 0;
+	};
+}
@@ -0,0 +1,280 @@
+#include "FakeDirectOutput.h"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include <Windows.h>
+#include <DirectOutput.h>
+#include "DirectOutputImpl.h"
+#include "types.h"
+
+namespace direct_output_proxy {
+	namespace {
+		struct FakeDevice {
+			DeviceType type;
+			GUID guid;
+			bool attached = true;
+			std::set<DWORD> pages;
+
+			Pfn_DirectOutput_PageChange page_cb = nullptr;
+			void* page_ctx = nullptr;
+			Pfn_DirectOutput_SoftButtonChange button_cb = nullptr;
+			void* button_ctx = nullptr;
+		};
+
+		struct FakeState {
+			std::mutex mutex;
+			std::chrono::microseconds latency{ 1000 };
+			std::atomic<uint64_t> calls = 0;
+			std::atomic<HRESULT> write_result = S_OK;
+
+			Pfn_DirectOutput_DeviceChange device_cb = nullptr;
+			void* device_ctx = nullptr;
+
+			FakeDevice x52_pro{ .type = DeviceType::kX52Pro, .guid = DeviceType_X52Pro };
+			// Attached by replayed device records, like a FIP plugged in while recording.
+			FakeDevice fip{ .type = DeviceType::kFip, .guid = DeviceType_Fip, .attached = false };
+		};
+
+		FakeState& State() {
+			static FakeState state;
+			return state;
+		}
+
+		FakeDevice* FindDevice(void* handle) {
+			for (FakeDevice* device : { &State().x52_pro, &State().fip }) {
+				if (handle == device && device->attached) return device;
+			}
+			return nullptr;
+		}
+
+		FakeDevice* FindDevice(const DeviceType type) {
+			for (FakeDevice* device : { &State().x52_pro, &State().fip }) {
+				if (type == device->type) return device;
+			}
+			return nullptr;
+		}
+
+		// Accounts for a call, taking as long as a real one would.
+		void Simulate() {
+			FakeState& state = State();
+			++state.calls;
+			if (state.latency.count() > 0) std::this_thread::sleep_for(state.latency);
+		}
+
+		HRESULT __stdcall Initialize(const wchar_t* plugin_name) {
+			Simulate();
+			return S_OK;
+		}
+
+		HRESULT __stdcall Deinitialize() {
+			Simulate();
+			return S_OK;
+		}
+
+		HRESULT __stdcall RegisterDeviceCallback(Pfn_DirectOutput_DeviceChange callback, void* ctx) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			State().device_cb = callback;
+			State().device_ctx = ctx;
+			return S_OK;
+		}
+
+		HRESULT __stdcall Enumerate(Pfn_DirectOutput_EnumerateCallback callback, void* ctx) {
+			Simulate();
+			for (FakeDevice* device : { &State().x52_pro, &State().fip }) {
+				if (device->attached) callback(device, ctx);
+			}
+			return S_OK;
+		}
+
+		HRESULT __stdcall RegisterPageCallback(void* handle, Pfn_DirectOutput_PageChange callback, void* ctx) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			FakeDevice* device = FindDevice(handle);
+			if (device == nullptr) return E_HANDLE;
+			device->page_cb = callback;
+			device->page_ctx = ctx;
+			return S_OK;
+		}
+
+		HRESULT __stdcall RegisterSoftButtonCallback(void* handle, Pfn_DirectOutput_SoftButtonChange callback, void* ctx) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			FakeDevice* device = FindDevice(handle);
+			if (device == nullptr) return E_HANDLE;
+			device->button_cb = callback;
+			device->button_ctx = ctx;
+			return S_OK;
+		}
+
+		HRESULT __stdcall GetDeviceType(void* handle, LPGUID guid) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			FakeDevice* device = FindDevice(handle);
+			if (device == nullptr) return E_HANDLE;
+			*guid = device->guid;
+			return S_OK;
+		}
+
+		HRESULT __stdcall GetDeviceInstance(void* handle, LPGUID guid) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			if (FindDevice(handle) == nullptr) return E_HANDLE;
+			*guid = GUID{};
+			return S_OK;
+		}
+
+		HRESULT __stdcall SetProfile(void* handle, DWORD length, const wchar_t* profile) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			return FindDevice(handle) == nullptr ? E_HANDLE : S_OK;
+		}
+
+		HRESULT __stdcall AddPage(void* handle, DWORD page, DWORD flags) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			FakeDevice* device = FindDevice(handle);
+			if (device == nullptr) return E_HANDLE;
+			return device->pages.insert(page).second ? S_OK : E_INVALIDARG;
+		}
+
+		HRESULT __stdcall RemovePage(void* handle, DWORD page) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			FakeDevice* device = FindDevice(handle);
+			if (device == nullptr) return E_HANDLE;
+			return device->pages.erase(page) > 0 ? S_OK : E_INVALIDARG;
+		}
+
+		// Common part of the calls which write to a page.
+		HRESULT WritePage(void* handle, DWORD page) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			FakeDevice* device = FindDevice(handle);
+			if (device == nullptr) return E_HANDLE;
+			if (!device->pages.contains(page)) return E_INVALIDARG;
+			return State().write_result;
+		}
+
+		HRESULT __stdcall SetLed(void* handle, DWORD page, DWORD index, DWORD value) {
+			return WritePage(handle, page);
+		}
+
+		HRESULT __stdcall SetString(void* handle, DWORD page, DWORD index, DWORD length, const wchar_t* value) {
+			return WritePage(handle, page);
+		}
+
+		HRESULT __stdcall SetImage(void* handle, DWORD page, DWORD index, DWORD size, const void* value) {
+			return WritePage(handle, page);
+		}
+
+		HRESULT __stdcall SetImageFromFile(void* handle, DWORD page, DWORD index, DWORD length, const wchar_t* filename) {
+			return WritePage(handle, page);
+		}
+
+		HRESULT __stdcall SaveFile(void* handle, DWORD page, DWORD file, DWORD length, const wchar_t* filename, PSRequestStatus status) {
+			return WritePage(handle, page);
+		}
+
+		HRESULT __stdcall DisplayFile(void* handle, DWORD page, DWORD index, DWORD file, PSRequestStatus status) {
+			return WritePage(handle, page);
+		}
+
+		HRESULT __stdcall DeleteDeviceFile(void* handle, DWORD page, DWORD file, PSRequestStatus status) {
+			return WritePage(handle, page);
+		}
+
+		HRESULT __stdcall GetSerialNumber(void* handle, wchar_t* serial, DWORD size) {
+			Simulate();
+			std::lock_guard lock(State().mutex);
+			if (FindDevice(handle) == nullptr) return E_HANDLE;
+			if (size > 0) wcsncpy_s(serial, size, L"FAKE", _TRUNCATE);
+			return S_OK;
+		}
+	}
+
+	void FakeDirectOutput::Install(CDirectOutput& direct_output) {
+		direct_output.m_initialize = &Initialize;
+		direct_output.m_deinitialize = &Deinitialize;
+		direct_output.m_registerdevicecallback = &RegisterDeviceCallback;
+		direct_output.m_enumerate = &Enumerate;
+		direct_output.m_registerpagecallback = &RegisterPageCallback;
+		direct_output.m_registersoftbuttoncallback = &RegisterSoftButtonCallback;
+		direct_output.m_getdevicetype = &GetDeviceType;
+		direct_output.m_getdeviceinstance = &GetDeviceInstance;
+		direct_output.m_setprofile = &SetProfile;
+		direct_output.m_addpage = &AddPage;
+		direct_output.m_removepage = &RemovePage;
+		direct_output.m_setled = &SetLed;
+		direct_output.m_setstring = &SetString;
+		direct_output.m_setimage = &SetImage;
+		direct_output.m_setimagefromfile = &SetImageFromFile;
+		direct_output.m_savefile = &SaveFile;
+		direct_output.m_displayfile = &DisplayFile;
+		direct_output.m_deletefile = &DeleteDeviceFile;
+		direct_output.m_getserialnumber = &GetSerialNumber;
+	}
+
+	void FakeDirectOutput::SetCallLatency(const std::chrono::microseconds latency) {
+		State().latency = latency;
+	}
+
+	void FakeDirectOutput::SetWriteResult(const HRESULT result) {
+		State().write_result = result;
+	}
+
+	uint64_t FakeDirectOutput::GetCallCount() {
+		return State().calls;
+	}
+
+	void FakeDirectOutput::InjectButtons(const DeviceType type, const DWORD buttons) {
+		Pfn_DirectOutput_SoftButtonChange callback = nullptr;
+		void* ctx = nullptr;
+		FakeDevice* device = nullptr;
+		{
+			std::lock_guard lock(State().mutex);
+			device = FindDevice(type);
+			if (device == nullptr || !device->attached) return;
+			callback = device->button_cb;
+			ctx = device->button_ctx;
+		}
+		if (callback != nullptr) callback(device, buttons, ctx);
+	}
+
+	void FakeDirectOutput::InjectPage(const DeviceType type, const DWORD page, const bool activated) {
+		Pfn_DirectOutput_PageChange callback = nullptr;
+		void* ctx = nullptr;
+		FakeDevice* device = nullptr;
+		{
+			std::lock_guard lock(State().mutex);
+			device = FindDevice(type);
+			if (device == nullptr || !device->attached) return;
+			callback = device->page_cb;
+			ctx = device->page_ctx;
+		}
+		if (callback != nullptr) callback(device, page, activated, ctx);
+	}
+
+	void FakeDirectOutput::InjectDevice(const DeviceType type, const bool added) {
+		Pfn_DirectOutput_DeviceChange callback = nullptr;
+		void* ctx = nullptr;
+		FakeDevice* device = nullptr;
+		{
+			std::lock_guard lock(State().mutex);
+			device = FindDevice(type);
+			if (device == nullptr || device->attached == added) return;
+			device->attached = added;
+			if (!added) {
+				device->pages.clear();
+				device->page_cb = nullptr;
+				device->button_cb = nullptr;
+			}
+			callback = State().device_cb;
+			ctx = State().device_ctx;
+		}
+		if (callback != nullptr) callback(device, added, ctx);
+	}
+}
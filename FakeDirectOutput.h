@@ -0,0 +1,34 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include <Windows.h>
+#include "DirectOutputImpl.h"
+#include "types.h"
+
+namespace direct_output_proxy {
+	// In-process stand-in for the DirectOutput library, with one X52 Pro attached, and a FIP which is attached
+	// by injecting it.
+	// Every call takes a configurable time, like a USB round trip would. Device events can be injected, which
+	// runs the callbacks registered by the proxy on the calling thread.
+	// The state is global, like the real library's.
+	class FakeDirectOutput {
+	public:
+		// Makes `direct_output` use the fake. It should be constructed without loading the library.
+		static void Install(CDirectOutput& direct_output);
+
+		static void SetCallLatency(std::chrono::microseconds latency);
+
+		// Makes the calls which write to a page fail with `result`, or succeed again with S_OK.
+		static void SetWriteResult(HRESULT result);
+
+		// Number of calls made to the fake so far.
+		static uint64_t GetCallCount();
+
+		// The injected events are ignored if there is no attached fake device of the type.
+		static void InjectButtons(DeviceType type, DWORD buttons);
+		static void InjectPage(DeviceType type, DWORD page, bool activated);
+		static void InjectDevice(DeviceType type, bool added);
+	};
+}
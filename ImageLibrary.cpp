@@ -0,0 +1,116 @@
+#include "ImageLibrary.h"
+
+#include <fstream>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <Windows.h>
+#include "utils.h"
+
+namespace direct_output_proxy {
+	namespace {
+		// Returns the file extension for the image format, or nullptr if it's not one the library can load.
+		const char* GetImageExtension(const std::string& content) {
+			if (content.size() >= 2 && content[0] == 'B' && content[1] == 'M') return ".bmp";
+			if (content.size() >= 3 && static_cast<uint8_t>(content[0]) == 0xff && static_cast<uint8_t>(content[1]) == 0xd8 &&
+				static_cast<uint8_t>(content[2]) == 0xff) return ".jpg";
+			return nullptr;
+		}
+
+		uint32_t ReadLittleEndian(const std::string& content, const size_t offset) {
+			uint32_t value = 0;
+			for (size_t i = 0; i < 4; ++i) value |= static_cast<uint32_t>(static_cast<uint8_t>(content[offset + i])) << (8 * i);
+			return value;
+		}
+
+		uint16_t ReadBigEndian16(const std::string& content, const size_t offset) {
+			return static_cast<uint16_t>(static_cast<uint8_t>(content[offset]) << 8 | static_cast<uint8_t>(content[offset + 1]));
+		}
+
+		// Reads the width and height from the BMP info header or the JPEG frame header.
+		std::optional<std::pair<DWORD, DWORD>> GetImageSize(const std::string& content) {
+			if (content[0] == 'B') {
+				if (content.size() < 26) return std::nullopt;
+				// Negative heights are top-down bitmaps.
+				const int32_t height = static_cast<int32_t>(ReadLittleEndian(content, 22));
+				return std::pair<DWORD, DWORD>(ReadLittleEndian(content, 18), height < 0 ? -height : height);
+			}
+
+			size_t offset = 2;
+			while (offset + 4 <= content.size()) {
+				if (static_cast<uint8_t>(content[offset]) != 0xff) return std::nullopt;
+				const uint8_t marker = static_cast<uint8_t>(content[offset + 1]);
+				// Start of frame, except DHT, JPG and DAC which share the range.
+				if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+					if (offset + 9 > content.size()) return std::nullopt;
+					return std::pair<DWORD, DWORD>(ReadBigEndian16(content, offset + 7), ReadBigEndian16(content, offset + 5));
+				}
+				offset += 2 + ReadBigEndian16(content, offset + 2);
+			}
+			return std::nullopt;
+		}
+	}
+
+	ImageFile::ImageFile(std::filesystem::path path) : path_(std::move(path)) {
+	}
+
+	ImageFile::~ImageFile() {
+		std::error_code ec;
+		std::filesystem::remove(path_, ec);
+	}
+
+	ImageLibrary::ImageLibrary(std::filesystem::path directory) : directory_(std::move(directory)) {
+		std::error_code ec;
+		std::filesystem::create_directories(directory_, ec);
+		if (ec) Debug() << "images: failed to create " << directory_.string() << ": " << ec.message() << std::endl;
+	}
+
+	bool ImageLibrary::IsValidId(const std::string& id) {
+		if (id.empty() || id.size() > 64) return false;
+		for (const char c : id) {
+			const bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+			if (!valid) return false;
+		}
+		return true;
+	}
+
+	HRESULT ImageLibrary::Store(const std::string& id, const std::string& content) {
+		if (!IsValidId(id)) return E_INVALIDARG;
+		if (content.size() > kMaxImageBytes) return E_OUTOFMEMORY;
+		const char* extension = GetImageExtension(content);
+		if (extension == nullptr) return E_INVALIDARG;
+		std::optional<std::pair<DWORD, DWORD>> size = GetImageSize(content);
+		if (!size.has_value()) return E_INVALIDARG;
+
+		std::lock_guard lock(mutex_);
+		// Replacing an image doesn't make the library bigger.
+		if (images_.size() >= kMaxLibraryImages && !images_.contains(id)) return E_OUTOFMEMORY;
+		const uint64_t version = next_version_++;
+		// A new file per version, so a file being replaced is never seen half written.
+		std::filesystem::path path = directory_ / (id + "-" + std::to_string(version) + extension);
+		// Also removes what was written if writing fails.
+		auto file = std::make_shared<const ImageFile>(path);
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		if (!out.write(content.data(), content.size())) return E_FAIL;
+		out.close();
+
+		// The file of the previous version goes once the devices using it are done with it.
+		images_[id] = { .id = id, .version = version, .path = path.wstring(), .file = std::move(file), .width = size->first,
+			.height = size->second };
+		return S_OK;
+	}
+
+	std::optional<LibraryImage> ImageLibrary::Get(const std::string& id) {
+		std::lock_guard lock(mutex_);
+		auto it = images_.find(id);
+		if (it == images_.end()) return std::nullopt;
+		return it->second;
+	}
+
+	size_t ImageLibrary::GetSize() {
+		std::lock_guard lock(mutex_);
+		return images_.size();
+	}
+}
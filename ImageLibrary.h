@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include <Windows.h>
+
+namespace direct_output_proxy {
+	// A FIP image is 320x240, so 1 MiB fits any BMP of it with room to spare.
+	constexpr size_t kMaxImageBytes = 1 << 20;
+	constexpr size_t kMaxLibraryImages = 256;
+
+	// A file of the library. It's removed once nothing refers to it any more, neither the library nor a
+	// LibraryImage, e.g. one being saved to a device while the image is replaced.
+	class ImageFile {
+	public:
+		explicit ImageFile(std::filesystem::path path);
+		ImageFile(const ImageFile&) = delete;
+		ImageFile& operator=(const ImageFile&) = delete;
+		~ImageFile();
+	private:
+		std::filesystem::path path_;
+	};
+
+	struct LibraryImage {
+		std::string id;
+		// Changes whenever the image is replaced, so copies saved on devices can be told apart.
+		uint64_t version = 0;
+		std::wstring path;
+		// Keeps the file at `path`.
+		std::shared_ptr<const ImageFile> file;
+		DWORD width = 0;
+		DWORD height = 0;
+	};
+
+	// Images uploaded by clients, kept as files the DirectOutput library can save to a FIP.
+	// Thread-safe.
+	class ImageLibrary {
+	public:
+		// Keeps the files in `directory`, which is created if needed.
+		explicit ImageLibrary(std::filesystem::path directory);
+
+		// IDs are 1 to 64 characters out of letters, digits, '-' and '_'.
+		static bool IsValidId(const std::string& id);
+
+		// Adds or replaces an image. `content` must be a BMP or JPEG file whose size can be read. Fails with
+		// E_INVALIDARG if it's not, and with E_OUTOFMEMORY if it's over kMaxImageBytes or the library already has
+		// kMaxLibraryImages other images.
+		HRESULT Store(const std::string& id, const std::string& content);
+
+		std::optional<LibraryImage> Get(const std::string& id);
+
+		size_t GetSize();
+	private:
+		std::filesystem::path directory_;
+		std::mutex mutex_;
+		std::map<std::string, LibraryImage> images_;
+		uint64_t next_version_ = 1;
+	};
+}
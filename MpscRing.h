@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace direct_output_proxy {
+	// Lock-free multiple producer, single consumer ring buffer. Producers claim a cell by moving the head, and
+	// each cell has a sequence number telling whether it's free to write, or written and ready to read.
+	template <typename T, size_t N>
+	class MpscRing {
+		static_assert(N > 1 && (N & (N - 1)) == 0, "size must be a power of 2");
+		static_assert(std::is_trivially_copyable_v<T>, "items are copied between threads");
+	public:
+		MpscRing() {
+			for (size_t i = 0; i < N; ++i) cells_[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		MpscRing(const MpscRing&) = delete;
+		MpscRing& operator=(const MpscRing&) = delete;
+
+		// Producer side, any thread. Returns false if the ring is full.
+		bool Push(const T& item) {
+			size_t head = head_.load(std::memory_order_relaxed);
+			while (true) {
+				Cell& cell = cells_[head % N];
+				const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+				const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(head);
+				if (difference == 0) {
+					// The cell is free. On failure `head` is reloaded and the next cell is tried.
+					if (head_.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+						cell.item = item;
+						cell.sequence.store(head + 1, std::memory_order_release);
+						return true;
+					}
+				} else if (difference < 0) {
+					// The cell still holds the item from the previous lap, which hasn't been read.
+					return false;
+				} else {
+					head = head_.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// Consumer side, one thread only. Returns false if the ring is empty, or the next item is claimed but
+		// not written yet.
+		bool Pop(T* item) {
+			Cell& cell = cells_[tail_ % N];
+			if (cell.sequence.load(std::memory_order_acquire) != tail_ + 1) return false;
+			*item = cell.item;
+			cell.sequence.store(tail_ + N, std::memory_order_release);
+			++tail_;
+			return true;
+		}
+	private:
+		struct Cell {
+			std::atomic<size_t> sequence;
+			T item;
+		};
+
+		alignas(64) std::atomic<size_t> head_{ 0 };
+		// Only used by the consumer.
+		alignas(64) size_t tail_ = 0;
+		Cell cells_[N];
+	};
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <crow/app.h>
+#include <crow/http_request.h>
+#include <crow/http_response.h>
+
+#include <optional>
+
+#include "DeviceExecutor.h"
+#include "TrafficLog.h"
+#include "Tracer.h"
+#include "types.h"
+#include "utils.h"
+
+namespace direct_output_proxy {
+	// Crow middleware which runs the SDK calls of a request in the lane given by its `lane` param.
+	struct WriteLaneMiddleware {
+		struct context {
+			std::optional<WriteLaneScope> scope;
+		};
+
+		void before_handle(crow::request& req, crow::response& res, context& ctx) {
+			const char* param = req.url_params.get("lane");
+			if (param == nullptr) return;
+			std::optional<WriteLane> lane = WriteLaneFromString(param);
+			if (!lane.has_value()) {
+				res = crow::response(400, "invalid param: lane");
+				res.end();
+				return;
+			}
+			ctx.scope.emplace(lane.value());
+		}
+
+		void after_handle(crow::request& req, crow::response& res, context& ctx) {
+			ctx.scope.reset();
+		}
+	};
+
+	// The Crow app of the proxy, with its middlewares.
+	using ProxyApp = crow::App<RecordingMiddleware, TracingMiddleware, WriteLaneMiddleware>;
+}
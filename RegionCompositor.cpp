@@ -0,0 +1,74 @@
+#include "RegionCompositor.h"
+
+#include <algorithm>
+
+namespace direct_output_proxy {
+	RegionCompositor::RegionCompositor(const DWORD line_width) : line_width_(line_width) {
+	}
+
+	void RegionCompositor::Set(const DWORD page, const RegionKey& key, const Region& region) {
+		std::lock_guard lock(mutex_);
+		regions_[page][key] = region;
+	}
+
+	std::optional<LineIndex> RegionCompositor::Remove(const DWORD page, const RegionKey& key) {
+		std::lock_guard lock(mutex_);
+		auto it = regions_.find(page);
+		if (it == regions_.end()) return std::nullopt;
+		auto region = it->second.find(key);
+		if (region == it->second.end()) return std::nullopt;
+		const LineIndex line = region->second.line;
+		it->second.erase(region);
+		if (it->second.empty()) regions_.erase(it);
+		return line;
+	}
+
+	void RegionCompositor::RemovePage(const DWORD page) {
+		std::lock_guard lock(mutex_);
+		regions_.erase(page);
+	}
+
+	std::vector<DWORD> RegionCompositor::Expire(const std::chrono::steady_clock::time_point now) {
+		std::vector<DWORD> changed;
+		std::lock_guard lock(mutex_);
+		for (auto it = regions_.begin(); it != regions_.end();) {
+			const size_t expired = std::erase_if(it->second, [now](const auto& item) {
+				return item.second.expires <= now;
+			});
+			if (expired > 0) changed.push_back(it->first);
+			it = it->second.empty() ? regions_.erase(it) : std::next(it);
+		}
+		return changed;
+	}
+
+	std::wstring RegionCompositor::Compose(const DWORD page, const LineIndex line, const std::wstring& base) {
+		std::vector<const Region*> regions;
+		std::lock_guard lock(mutex_);
+		auto it = regions_.find(page);
+		if (it == regions_.end()) return base;
+		for (const auto& [key, region] : it->second) {
+			if (region.line == line && region.column < line_width_) regions.push_back(&region);
+		}
+		if (regions.empty()) return base;
+		// Stable, so equal priorities stay in the order of their keys.
+		std::stable_sort(regions.begin(), regions.end(), [](const Region* a, const Region* b) { return a->priority < b->priority; });
+
+		std::wstring composed = base;
+		for (const Region* region : regions) {
+			const DWORD room = line_width_ - region->column;
+			const DWORD width = region->width == 0 ? room : std::min(region->width, room);
+			if (composed.size() < region->column + width) composed.resize(region->column + width, L' ');
+			std::wstring content = region->content.substr(0, width);
+			content.resize(width, L' ');
+			composed.replace(region->column, width, content);
+		}
+		return composed;
+	}
+
+	size_t RegionCompositor::GetSize() {
+		std::lock_guard lock(mutex_);
+		size_t size = 0;
+		for (const auto& [page, regions] : regions_) size += regions.size();
+		return size;
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <Windows.h>
+#include "types.h"
+
+namespace direct_output_proxy {
+	// How often expired regions are removed.
+	constexpr std::chrono::milliseconds kRegionExpiryInterval(100);
+	// How long a region lasts unless the client says otherwise, and the longest it can ask for. Regions always
+	// expire, so the regions of a client which went away don't stay on the device.
+	constexpr std::chrono::seconds kDefaultRegionTtl(30);
+	constexpr std::chrono::seconds kMaxRegionTtl(3600);
+
+	// Identifies a region: the client owning it, and the ID the client chose. Clients can't see or replace each
+	// other's regions, even with the same ID.
+	using RegionKey = std::pair<std::string, std::string>;
+
+	// A part of a line owned by a client, drawn over the line of the page.
+	struct Region {
+		LineIndex line = kTopLine;
+		DWORD column = 0;
+		// Characters covered, 0 for the rest of the line. The content is cut or padded with spaces to fit.
+		DWORD width = 0;
+		// Higher priorities are drawn over lower ones. Equal priorities are drawn in the order of their keys.
+		int priority = 0;
+		std::wstring content;
+		std::chrono::steady_clock::time_point expires;
+	};
+
+	// Lets several clients share the lines of a page: each owns regions, identified by a RegionKey per page, which
+	// are composited over the lines of the page. Thread-safe.
+	class RegionCompositor {
+	public:
+		explicit RegionCompositor(DWORD line_width);
+
+		// Adds or replaces the region `key` of the page.
+		void Set(DWORD page, const RegionKey& key, const Region& region);
+
+		// Returns the line the region was on, if it existed.
+		std::optional<LineIndex> Remove(DWORD page, const RegionKey& key);
+
+		void RemovePage(DWORD page);
+
+		// Removes the regions which expired by `now`. Returns the pages whose lines changed.
+		std::vector<DWORD> Expire(std::chrono::steady_clock::time_point now);
+
+		// Returns `base` with the regions of the line drawn over it.
+		std::wstring Compose(DWORD page, LineIndex line, const std::wstring& base);
+
+		size_t GetSize();
+	private:
+		const DWORD line_width_;
+
+		std::mutex mutex_;
+		// Page -> key -> region.
+		std::map<DWORD, std::map<RegionKey, Region>> regions_;
+	};
+}
@@ -0,0 +1,75 @@
+#include "SdkEventDispatcher.h"
+
+#include <format>
+#include <string>
+
+namespace direct_output_proxy {
+	SdkEventDispatcher::SdkEventDispatcher(std::function<void(const SdkEvent&)> handler) : handler_(std::move(handler)) {
+	}
+
+	SdkEventDispatcher::~SdkEventDispatcher() {
+		Stop();
+	}
+
+	void SdkEventDispatcher::Start() {
+		if (thread_.joinable()) return;
+		stop_ = false;
+		thread_ = std::thread([this]() {
+			Run();
+		});
+	}
+
+	void SdkEventDispatcher::Stop() {
+		if (!thread_.joinable()) return;
+		stop_ = true;
+		signal_.fetch_add(1);
+		signal_.notify_one();
+		thread_.join();
+	}
+
+	bool SdkEventDispatcher::Push(const SdkEvent& event) {
+		if (event.type == SdkEventType::kDeviceAdded || event.type == SdkEventType::kDeviceRemoved) {
+			std::lock_guard lock(device_events_mutex_);
+			device_events_.push_back(event);
+		} else if (!ring_.Push(event)) {
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		signal_.fetch_add(1, std::memory_order_release);
+		signal_.notify_one();
+		return true;
+	}
+
+	void SdkEventDispatcher::Dispatch(const SdkEvent& event) {
+		const int64_t delay_us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - event.time).count();
+		if (delay_us > max_delay_us_.load(std::memory_order_relaxed)) max_delay_us_.store(delay_us, std::memory_order_relaxed);
+		handler_(event);
+		dispatched_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void SdkEventDispatcher::Run() {
+		SdkEvent event;
+		while (true) {
+			// Read before checking the queues, so a push after the check changes it and the wait returns.
+			const uint32_t seen = signal_.load(std::memory_order_acquire);
+			// Devices first, so buttons of a new device find it. Buttons queued for a removed device are
+			// dropped by the handler, which no longer finds it.
+			std::deque<SdkEvent> device_events;
+			{
+				std::lock_guard lock(device_events_mutex_);
+				device_events.swap(device_events_);
+			}
+			for (const SdkEvent& device_event : device_events) Dispatch(device_event);
+			while (ring_.Pop(&event)) Dispatch(event);
+			if (stop_) return;
+			signal_.wait(seen, std::memory_order_acquire);
+		}
+	}
+
+	std::string SdkEventDispatcher::GetInfo() {
+		return std::format("sdk events: dispatched {}, dropped {}, max delay {}us",
+			dispatched_.load(std::memory_order_relaxed), dropped_.load(std::memory_order_relaxed),
+			max_delay_us_.load(std::memory_order_relaxed));
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <Windows.h>
+#include "MpscRing.h"
+
+namespace direct_output_proxy {
+	// Button and page events queued at most. Further ones are dropped, as the SDK thread must never wait.
+	constexpr size_t kSdkEventQueueSize = 1024;
+
+	enum class SdkEventType : uint8_t {
+		kButtons,
+		kPage,
+		kDeviceAdded,
+		kDeviceRemoved,
+	};
+
+	// A raw callback from the DirectOutput library.
+	struct SdkEvent {
+		SdkEventType type = SdkEventType::kButtons;
+		// The SDK handle of the device.
+		void* device = nullptr;
+		// kButtons: the pressed buttons. kPage: the page.
+		DWORD value = 0;
+		// kPage: activated.
+		bool activated = false;
+		// When the library called back.
+		std::chrono::steady_clock::time_point time;
+	};
+
+	// Moves SDK callbacks off the library's thread. Push() only copies the event into a ring buffer, and a
+	// dispatcher thread hands the events to `handler` in the order they came in.
+	// Device callbacks also come from the thread enumerating devices, so any thread may push. Devices being added
+	// or removed are never dropped: they go to a separate queue, which is handled before the ring.
+	class SdkEventDispatcher {
+	public:
+		explicit SdkEventDispatcher(std::function<void(const SdkEvent&)> handler);
+		SdkEventDispatcher(const SdkEventDispatcher&) = delete;
+		SdkEventDispatcher& operator=(const SdkEventDispatcher&) = delete;
+		~SdkEventDispatcher();
+
+		void Start();
+
+		// Handles the events queued so far, then stops the dispatcher thread.
+		void Stop();
+
+		// Producer side, lock-free for button and page events. Returns false if the event was dropped because
+		// the ring is full.
+		bool Push(const SdkEvent& event);
+
+		std::string GetInfo();
+	private:
+		void Dispatch(const SdkEvent& event);
+		void Run();
+
+		std::function<void(const SdkEvent&)> handler_;
+		MpscRing<SdkEvent, kSdkEventQueueSize> ring_;
+		std::mutex device_events_mutex_;
+		std::deque<SdkEvent> device_events_;
+		// Bumped after every push, and on stop. The dispatcher waits on it when the ring is empty.
+		std::atomic<uint32_t> signal_ = 0;
+		std::atomic<bool> stop_ = false;
+		std::thread thread_;
+
+		std::atomic<uint64_t> dropped_ = 0;
+		// Only written by the dispatcher thread.
+		std::atomic<uint64_t> dispatched_ = 0;
+		std::atomic<int64_t> max_delay_us_ = 0;
+	};
+}
@@ -0,0 +1,401 @@
+#include "SharedMemoryChannel.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "SharedMemoryLayout.h"
+
+namespace direct_output_proxy {
+	namespace {
+		// How long the channel thread sleeps at most, so that it notices Stop().
+		constexpr uint32_t kWaitTimeoutMs = 100;
+		// How long the channel thread waits before retrying what a handler failed.
+		constexpr uint32_t kRetryIntervalMs = 100;
+		// How often a torn read of a PageState is retried before leaving it for the next round.
+		constexpr int kSeqlockReadAttempts = 16;
+
+		// Copies the content of a PageState. Returns false if the client kept writing it.
+		bool ReadPageState(shm::PageState& state, shm::PageContent* content) {
+			for (int attempt = 0; attempt < kSeqlockReadAttempts; ++attempt) {
+				const uint32_t before = state.seq.load(std::memory_order_acquire);
+				if (before & 1) {
+					std::this_thread::yield();
+					continue;
+				}
+				std::memcpy(content, &state.content, sizeof(*content));
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (state.seq.load(std::memory_order_relaxed) == before) return true;
+			}
+			return false;
+		}
+
+		bool Failed(const HRESULT result) {
+			return result < 0;
+		}
+
+		bool SameLine(const shm::PageContent& a, const shm::PageContent& b, const uint32_t line) {
+			return a.line_lengths[line] == b.line_lengths[line] &&
+				std::equal(a.lines[line], a.lines[line] + a.line_lengths[line], b.lines[line]);
+		}
+	}
+
+	SharedRegion::~SharedRegion() {
+		Close();
+	}
+
+#ifdef _WIN32
+	bool SharedRegion::Open(const std::string& name, const bool create) {
+		name_ = name;
+		owner_ = create;
+		std::wstring mapping_name = L"Local\\" + std::wstring(name.begin(), name.end());
+		std::wstring event_name = mapping_name + L".wake";
+
+		if (create) {
+			mapping_ = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(shm::Block), mapping_name.c_str());
+			event_ = CreateEventW(nullptr, FALSE, FALSE, event_name.c_str());
+		} else {
+			mapping_ = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, mapping_name.c_str());
+			event_ = OpenEventW(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, event_name.c_str());
+		}
+		if (mapping_ == nullptr || event_ == nullptr) {
+			Close();
+			return false;
+		}
+
+		void* view = MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(shm::Block));
+		if (view == nullptr) {
+			Close();
+			return false;
+		}
+		block_ = static_cast<shm::Block*>(view);
+		if (create) {
+			block_ = new (view) shm::Block();
+			block_->layout_version = shm::kLayoutVersion;
+			block_->magic.store(shm::kMagic, std::memory_order_release);
+		}
+		return true;
+	}
+
+	void SharedRegion::Close() {
+		if (block_ != nullptr) UnmapViewOfFile(block_);
+		if (mapping_ != nullptr) CloseHandle(mapping_);
+		if (event_ != nullptr) CloseHandle(event_);
+		block_ = nullptr;
+		mapping_ = nullptr;
+		event_ = nullptr;
+	}
+
+	void SharedRegion::Notify() {
+		SetEvent(event_);
+	}
+
+	bool SharedRegion::Wait(const uint32_t timeout_ms) {
+		return WaitForSingleObject(event_, timeout_ms) == WAIT_OBJECT_0;
+	}
+#else
+	bool SharedRegion::Open(const std::string& name, const bool create) {
+		name_ = "/" + name;
+		owner_ = create;
+
+		int fd = shm_open(name_.c_str(), O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0600);
+		if (fd < 0) return false;
+		if (create && ftruncate(fd, sizeof(shm::Block)) != 0) {
+			close(fd);
+			Close();
+			return false;
+		}
+		void* view = mmap(nullptr, sizeof(shm::Block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (view == MAP_FAILED) {
+			Close();
+			return false;
+		}
+		block_ = static_cast<shm::Block*>(view);
+
+		sem_ = create ? sem_open((name_ + ".wake").c_str(), O_CREAT, 0600, 0) : sem_open((name_ + ".wake").c_str(), 0);
+		if (sem_ == SEM_FAILED) {
+			sem_ = nullptr;
+			Close();
+			return false;
+		}
+
+		if (create) {
+			block_ = new (view) shm::Block();
+			block_->layout_version = shm::kLayoutVersion;
+			block_->magic.store(shm::kMagic, std::memory_order_release);
+		}
+		return true;
+	}
+
+	void SharedRegion::Close() {
+		if (block_ != nullptr) munmap(block_, sizeof(shm::Block));
+		if (sem_ != nullptr) sem_close(sem_);
+		if (owner_ && !name_.empty()) {
+			shm_unlink(name_.c_str());
+			sem_unlink((name_ + ".wake").c_str());
+		}
+		block_ = nullptr;
+		sem_ = nullptr;
+		owner_ = false;
+	}
+
+	void SharedRegion::Notify() {
+		sem_post(sem_);
+	}
+
+	bool SharedRegion::Wait(const uint32_t timeout_ms) {
+		timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += static_cast<long>(timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (sem_timedwait(sem_, &deadline) != 0) {
+			if (errno != EINTR) return false;
+		}
+		return true;
+	}
+#endif
+
+	SharedMemoryChannel::SharedMemoryChannel(SharedMemoryHandlers handlers) : handlers_(std::move(handlers)) {
+	}
+
+	SharedMemoryChannel::~SharedMemoryChannel() {
+		Stop();
+	}
+
+	bool SharedMemoryChannel::Start(const std::string& name) {
+		if (!region_.Open(name, /*create=*/true)) return false;
+		running_ = true;
+		thread_ = std::thread(&SharedMemoryChannel::Run, this);
+		return true;
+	}
+
+	void SharedMemoryChannel::Stop() {
+		if (!running_.exchange(false)) return;
+		region_.Notify();
+		thread_.join();
+		region_.Close();
+	}
+
+	void SharedMemoryChannel::Run() {
+		shm::Block* block = region_.block();
+		while (running_) {
+			const bool done = Drain();
+
+			// Clients check `sleeping` after publishing, so anything published after this store gets a notification.
+			block->sleeping.store(1);
+			if (!done) {
+				region_.Wait(kRetryIntervalMs);
+			} else if (block->dirty.load() == 0 && block->commands.Empty()) {
+				region_.Wait(kWaitTimeoutMs);
+			}
+			block->sleeping.store(0);
+		}
+	}
+
+	bool SharedMemoryChannel::Drain() {
+		shm::Block* block = region_.block();
+
+		// Commands first, so pages exist before their state is applied.
+		if (!RunCommands()) return false;
+
+		bool done = true;
+		uint32_t dirty = block->dirty.exchange(0, std::memory_order_acq_rel);
+		while (dirty != 0) {
+			const uint32_t index = std::countr_zero(dirty);
+			dirty &= dirty - 1;
+			if (!ApplyPage(index)) done = false;
+		}
+		return done;
+	}
+
+	bool SharedMemoryChannel::RunCommands() {
+		shm::Block* block = region_.block();
+		shm::Command command;
+		while (pending_.has_value() || block->commands.Pop(&command)) {
+			if (!pending_.has_value()) pending_ = command;
+			HRESULT result = 0;
+			switch (pending_->type) {
+			case shm::CommandType::kAddPage:
+				if (handlers_.add_page) result = handlers_.add_page(pending_->page, pending_->arg != 0);
+				break;
+			case shm::CommandType::kRemovePage:
+				if (handlers_.remove_page) result = handlers_.remove_page(pending_->page);
+				break;
+			default:
+				break;
+			}
+			// Later commands wait in the ring, so the client sees it fill up rather than commands being lost.
+			if (Failed(result)) return false;
+			pending_.reset();
+		}
+		return true;
+	}
+
+	bool SharedMemoryChannel::ApplyPage(const uint32_t index) {
+		shm::Block* block = region_.block();
+		shm::PageContent content;
+		if (!ReadPageState(block->pages[index], &content)) {
+			// The client is busy with this page, try again in the next round.
+			block->dirty.fetch_or(1u << index, std::memory_order_relaxed);
+			return true;
+		}
+
+		shm::PageContent& applied = applied_[index];
+		if (!content.in_use) {
+			applied = {};
+			return true;
+		}
+		if (!applied.in_use || applied.page != content.page) {
+			applied = {};
+			applied.in_use = 1;
+			applied.page = content.page;
+		}
+
+		bool done = true;
+		for (uint32_t line = 0; line < shm::kLines; ++line) {
+			if (!(content.line_mask & (1u << line))) continue;
+			const uint32_t length = std::min(content.line_lengths[line], shm::kLineChars);
+			content.line_lengths[line] = length;
+			if ((applied.line_mask & (1u << line)) && SameLine(applied, content, line)) continue;
+			if (handlers_.set_line) {
+				const char16_t* chars = content.lines[line];
+				if (Failed(handlers_.set_line(content.page, line, std::wstring(chars, chars + length)))) {
+					done = false;
+					continue;
+				}
+			}
+			std::copy_n(content.lines[line], length, applied.lines[line]);
+			applied.line_lengths[line] = length;
+			applied.line_mask |= 1u << line;
+		}
+
+		for (uint32_t led = 0; led < shm::kLeds; ++led) {
+			if (!(content.led_mask & (1u << led))) continue;
+			if ((applied.led_mask & (1u << led)) && applied.leds[led] == content.leds[led]) continue;
+			if (handlers_.set_led && Failed(handlers_.set_led(content.page, led, content.leds[led]))) {
+				done = false;
+				continue;
+			}
+			applied.leds[led] = content.leds[led];
+			applied.led_mask |= 1u << led;
+		}
+
+		// What failed is compared again in the next round, so only it is passed on again.
+		if (!done) block->dirty.fetch_or(1u << index, std::memory_order_relaxed);
+		return done;
+	}
+
+	bool SharedMemoryClient::Open(const std::string& name) {
+		if (!region_.Open(name, /*create=*/false)) return false;
+		shm::Block* block = region_.block();
+		if (block->magic.load(std::memory_order_acquire) != shm::kMagic || block->layout_version != shm::kLayoutVersion) {
+			region_.Close();
+			return false;
+		}
+		return true;
+	}
+
+	void SharedMemoryClient::Close() {
+		region_.Close();
+		state_index_.clear();
+	}
+
+	void SharedMemoryClient::NotifyIfSleeping() {
+		if (region_.block()->sleeping.exchange(0) != 0) region_.Notify();
+	}
+
+	bool SharedMemoryClient::PushCommand(const shm::Command& command) {
+		if (!region_.block()->commands.Push(command)) return false;
+		NotifyIfSleeping();
+		return true;
+	}
+
+	bool SharedMemoryClient::AddPage(const uint32_t page, const bool activate) {
+		return PushCommand({ .type = shm::CommandType::kAddPage, .page = page, .arg = activate ? 1u : 0u });
+	}
+
+	bool SharedMemoryClient::RemovePage(const uint32_t page) {
+		auto it = state_index_.find(page);
+		if (it != state_index_.end()) {
+			Publish(it->second, [](shm::PageContent& content) {
+				content = {};
+			});
+			state_index_.erase(it);
+		}
+		return PushCommand({ .type = shm::CommandType::kRemovePage, .page = page, .arg = 0 });
+	}
+
+	std::optional<uint32_t> SharedMemoryClient::GetStateIndex(const uint32_t page) {
+		auto it = state_index_.find(page);
+		if (it != state_index_.end()) return it->second;
+
+		for (uint32_t index = 0; index < shm::kStatePages; ++index) {
+			if (region_.block()->pages[index].content.in_use) continue;
+			state_index_[page] = index;
+			Publish(index, [page](shm::PageContent& content) {
+				content = {};
+				content.in_use = 1;
+				content.page = page;
+			});
+			return index;
+		}
+		return std::nullopt;
+	}
+
+	void SharedMemoryClient::Publish(const uint32_t index, const std::function<void(shm::PageContent&)>& update) {
+		shm::Block* block = region_.block();
+		shm::PageState& state = block->pages[index];
+
+		const uint32_t seq = state.seq.load(std::memory_order_relaxed);
+		state.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		update(state.content);
+		state.seq.store(seq + 2, std::memory_order_release);
+
+		block->dirty.fetch_or(1u << index);
+		NotifyIfSleeping();
+	}
+
+	bool SharedMemoryClient::SetLine(const uint32_t page, const uint32_t line, const std::u16string_view content) {
+		if (line >= shm::kLines) return false;
+		std::optional<uint32_t> index = GetStateIndex(page);
+		if (!index.has_value()) return false;
+
+		Publish(index.value(), [line, content](shm::PageContent& state) {
+			const uint32_t length = static_cast<uint32_t>(std::min<size_t>(content.size(), shm::kLineChars));
+			std::copy_n(content.data(), length, state.lines[line]);
+			state.line_lengths[line] = length;
+			state.line_mask |= 1u << line;
+		});
+		return true;
+	}
+
+	bool SharedMemoryClient::SetLed(const uint32_t page, const uint32_t index, const uint32_t value) {
+		if (index >= shm::kLeds) return false;
+		std::optional<uint32_t> state_index = GetStateIndex(page);
+		if (!state_index.has_value()) return false;
+
+		Publish(state_index.value(), [index, value](shm::PageContent& state) {
+			state.leds[index] = value;
+			state.led_mask |= 1u << index;
+		});
+		return true;
+	}
+}
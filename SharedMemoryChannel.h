@@ -0,0 +1,133 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <semaphore.h>
+#endif
+
+#include "SharedMemoryLayout.h"
+
+namespace direct_output_proxy {
+#ifndef _WIN32
+	using HRESULT = int32_t;
+#endif
+
+	constexpr const char* kSharedMemoryName = "DirectOutputProxy";
+
+	// A named shared memory block plus a named wake-up notification.
+	// Uses file mappings and events on Windows, and POSIX shared memory and semaphores elsewhere.
+	class SharedRegion {
+	public:
+		SharedRegion() = default;
+		SharedRegion(const SharedRegion&) = delete;
+		SharedRegion& operator=(const SharedRegion&) = delete;
+		~SharedRegion();
+
+		// Creates and initializes the block if `create`, otherwise opens an existing one.
+		bool Open(const std::string& name, bool create);
+		void Close();
+
+		shm::Block* block() {
+			return block_;
+		}
+
+		void Notify();
+
+		// Waits for a notification. Returns false on timeout.
+		bool Wait(uint32_t timeout_ms);
+	private:
+		std::string name_;
+		bool owner_ = false;
+		shm::Block* block_ = nullptr;
+#ifdef _WIN32
+		HANDLE mapping_ = nullptr;
+		HANDLE event_ = nullptr;
+#else
+		sem_t* sem_ = nullptr;
+#endif
+	};
+
+	// A handler fails for what should be retried, e.g. while no device is attached. What can never be applied
+	// should succeed, so that it's dropped.
+	struct SharedMemoryHandlers {
+		std::function<HRESULT(uint32_t page, bool activate)> add_page;
+		std::function<HRESULT(uint32_t page)> remove_page;
+		std::function<HRESULT(uint32_t page, uint32_t line, const std::wstring& content)> set_line;
+		std::function<HRESULT(uint32_t page, uint32_t index, uint32_t value)> set_led;
+	};
+
+	// Proxy side of the shared memory interface for local clients.
+	// A thread waits for client notifications, then runs the queued commands and applies the changed page state
+	// through the handlers. Only lines and LEDs which differ from what was applied last are passed on.
+	// A failed command is retried before any later one, and page state only counts as applied once its
+	// handler succeeded.
+	class SharedMemoryChannel {
+	public:
+		explicit SharedMemoryChannel(SharedMemoryHandlers handlers);
+		~SharedMemoryChannel();
+
+		bool Start(const std::string& name = kSharedMemoryName);
+		void Stop();
+	private:
+		void Run();
+
+		// Handles everything published so far. Returns false if something has to be retried.
+		bool Drain();
+
+		// Runs the queued commands in order, stopping at the first which fails.
+		bool RunCommands();
+
+		// Returns false if the page has to be applied again.
+		bool ApplyPage(uint32_t index);
+
+		SharedMemoryHandlers handlers_;
+		SharedRegion region_;
+		std::thread thread_;
+		std::atomic<bool> running_ = false;
+
+		// A command taken from the ring which failed, run again before the next one.
+		std::optional<shm::Command> pending_;
+		// What was applied from each PageState.
+		std::array<shm::PageContent, shm::kStatePages> applied_ = {};
+	};
+
+	// Client side of the shared memory interface, for publishers on the same machine as the proxy.
+	// Publishing only writes to shared memory, and only notifies the proxy if it's waiting.
+	// Not thread-safe, and there can be only one client per block at a time.
+	class SharedMemoryClient {
+	public:
+		bool Open(const std::string& name = kSharedMemoryName);
+		void Close();
+
+		// Pages have to be added before their lines or LEDs can be set.
+		bool AddPage(uint32_t page, bool activate);
+		bool RemovePage(uint32_t page);
+
+		bool SetLine(uint32_t page, uint32_t line, std::u16string_view content);
+		bool SetLed(uint32_t page, uint32_t index, uint32_t value);
+	private:
+		// Returns the index of the PageState of the page, claiming a free one if needed.
+		std::optional<uint32_t> GetStateIndex(uint32_t page);
+
+		// Runs `update` on the content of the PageState under its seqlock, then tells the proxy about it.
+		void Publish(uint32_t index, const std::function<void(shm::PageContent&)>& update);
+
+		bool PushCommand(const shm::Command& command);
+
+		void NotifyIfSleeping();
+
+		SharedRegion region_;
+		std::map<uint32_t, uint32_t> state_index_;
+	};
+}
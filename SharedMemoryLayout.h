@@ -0,0 +1,71 @@
+#pragma once
+
+// Layout of the shared memory block used by local clients. Only depends on the standard library, so clients
+// can include it as is.
+
+#include <atomic>
+#include <cstdint>
+
+#include "SpscRing.h"
+
+namespace direct_output_proxy::shm {
+	constexpr uint32_t kMagic = 0x58504f44;  // "DOPX"
+	constexpr uint32_t kLayoutVersion = 1;
+
+	// Pages which can be published through the state block at the same time.
+	constexpr uint32_t kStatePages = 32;
+	constexpr uint32_t kLines = 3;
+	constexpr uint32_t kLineChars = 32;
+	constexpr uint32_t kLeds = 32;
+	constexpr uint32_t kCommandRingSize = 256;
+
+	enum class CommandType : uint32_t {
+		kNone,
+		kAddPage,
+		kRemovePage,
+	};
+
+	struct Command {
+		CommandType type;
+		uint32_t page;
+		// kAddPage: 1 to activate the page.
+		uint32_t arg;
+	};
+
+	struct PageContent {
+		// 0 if the slot is free.
+		uint32_t in_use;
+		uint32_t page;
+		// Lines with a value. Others are left as they are.
+		uint32_t line_mask;
+		uint32_t line_lengths[kLines];
+		char16_t lines[kLines][kLineChars];
+		// LEDs with a value. Others are left as they are.
+		uint32_t led_mask;
+		uint32_t leds[kLeds];
+	};
+
+	// State of a page, written by the client under a seqlock.
+	struct PageState {
+		// Odd while the client is writing `content`.
+		std::atomic<uint32_t> seq;
+		PageContent content;
+	};
+
+	struct Block {
+		// Set by the proxy once the block is initialized.
+		std::atomic<uint32_t> magic;
+		uint32_t layout_version;
+
+		// Set by the proxy before waiting for the wake-up notification. Clients only notify if it's set.
+		std::atomic<uint32_t> sleeping;
+
+		// One bit per PageState which changed since the proxy last read it.
+		std::atomic<uint32_t> dirty;
+		PageState pages[kStatePages];
+
+		SpscRing<Command, kCommandRingSize> commands;
+	};
+
+	static_assert(kStatePages <= 32, "dirty is a 32 bit mask");
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace direct_output_proxy {
+	// Wait-free single producer, single consumer ring buffer.
+	// It holds no pointers and is valid when zero-initialized, so it can also live in shared memory.
+	template <typename T, size_t N>
+	class SpscRing {
+		static_assert(N > 0 && (N & (N - 1)) == 0, "size must be a power of 2");
+		static_assert(std::is_trivially_copyable_v<T>, "items are copied between threads or processes");
+		static_assert(std::atomic<uint32_t>::is_always_lock_free);
+	public:
+		// Producer side. Returns false if the ring is full.
+		bool Push(const T& item) {
+			const uint32_t head = head_.load(std::memory_order_relaxed);
+			if (head - tail_.load(std::memory_order_acquire) == N) return false;
+			items_[head % N] = item;
+			head_.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer side. Returns false if the ring is empty.
+		bool Pop(T* item) {
+			const uint32_t tail = tail_.load(std::memory_order_relaxed);
+			if (tail == head_.load(std::memory_order_acquire)) return false;
+			*item = items_[tail % N];
+			tail_.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool Empty() const {
+			return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+		}
+	private:
+		// Both indexes only grow, and wrap around together with uint32_t since N divides 2^32.
+		alignas(64) std::atomic<uint32_t> head_{ 0 };
+		alignas(64) std::atomic<uint32_t> tail_{ 0 };
+		T items_[N];
+	};
+}
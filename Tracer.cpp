@@ -0,0 +1,166 @@
+#include "Tracer.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+namespace direct_output_proxy {
+	namespace {
+		struct TraceEntry {
+			const char* name = nullptr;
+			uint64_t request = 0;
+			int64_t start_us = 0;
+			int64_t end_us = 0;
+			char detail[64] = {};
+		};
+
+		// Written by the thread holding it only. The mutex is only contended while the trace is exported.
+		struct TraceRing {
+			// Threads reusing the ring share its ID in the trace.
+			uint32_t thread = 0;
+			std::mutex mutex;
+			std::array<TraceEntry, kTraceRingSize> entries;
+			uint64_t next = 0;
+		};
+
+		struct TraceState {
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			std::atomic<uint32_t> sampling = 0;
+			std::atomic<uint64_t> requests = 0;
+			std::atomic<uint64_t> next_request = 1;
+
+			std::mutex rings_mutex;
+			// Every ring ever made, so the spans of finished threads can still be exported. There are only as many
+			// as threads which traced at the same time: a thread gives its ring back when it ends, and new threads
+			// take a free one before making another.
+			std::vector<std::unique_ptr<TraceRing>> rings;
+			std::vector<TraceRing*> free_rings;
+		};
+
+		TraceState& State() {
+			static TraceState state;
+			return state;
+		}
+
+		thread_local uint64_t current_request = 0;
+
+		// Holds the ring of a thread, and frees it when the thread ends.
+		class ThreadRing {
+		public:
+			ThreadRing() {
+				TraceState& state = State();
+				std::lock_guard lock(state.rings_mutex);
+				if (!state.free_rings.empty()) {
+					ring_ = state.free_rings.back();
+					state.free_rings.pop_back();
+					return;
+				}
+				state.rings.push_back(std::make_unique<TraceRing>());
+				ring_ = state.rings.back().get();
+				ring_->thread = static_cast<uint32_t>(state.rings.size());
+			}
+			ThreadRing(const ThreadRing&) = delete;
+			ThreadRing& operator=(const ThreadRing&) = delete;
+			~ThreadRing() {
+				TraceState& state = State();
+				std::lock_guard lock(state.rings_mutex);
+				state.free_rings.push_back(ring_);
+			}
+
+			TraceRing& Get() {
+				return *ring_;
+			}
+		private:
+			TraceRing* ring_;
+		};
+
+		TraceRing& GetThreadRing() {
+			thread_local ThreadRing ring;
+			return ring.Get();
+		}
+	}
+
+	void SetTraceSampling(const uint32_t one_in) {
+		State().sampling = one_in;
+	}
+
+	uint64_t BeginTraceRequest() {
+		TraceState& state = State();
+		const uint32_t one_in = state.sampling.load(std::memory_order_relaxed);
+		if (one_in == 0) return 0;
+		if (state.requests.fetch_add(1, std::memory_order_relaxed) % one_in != 0) return 0;
+		return state.next_request.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint64_t GetTraceRequest() {
+		return current_request;
+	}
+
+	void SetTraceRequest(const uint64_t request) {
+		current_request = request;
+	}
+
+	int64_t TraceNow() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - State().start).count();
+	}
+
+	void RecordTraceSpan(const char* name, const int64_t start_us, const int64_t end_us, const std::string_view detail) {
+		if (current_request == 0) return;
+		TraceRing& ring = GetThreadRing();
+		std::lock_guard lock(ring.mutex);
+		TraceEntry& entry = ring.entries[ring.next++ % ring.entries.size()];
+		entry.name = name;
+		entry.request = current_request;
+		entry.start_us = start_us;
+		entry.end_us = end_us;
+		const size_t length = std::min(detail.size(), sizeof(entry.detail) - 1);
+		std::memcpy(entry.detail, detail.data(), length);
+		entry.detail[length] = '\0';
+	}
+
+	std::string ExportTrace(const int seconds) {
+		const int64_t since = TraceNow() - static_cast<int64_t>(seconds) * 1000000;
+
+		std::vector<std::pair<uint32_t, TraceEntry>> spans;
+		{
+			TraceState& state = State();
+			std::lock_guard lock(state.rings_mutex);
+			for (const std::unique_ptr<TraceRing>& ring : state.rings) {
+				std::lock_guard ring_lock(ring->mutex);
+				const uint64_t count = std::min<uint64_t>(ring->next, ring->entries.size());
+				for (uint64_t i = ring->next - count; i < ring->next; ++i) {
+					const TraceEntry& entry = ring->entries[i % ring->entries.size()];
+					if (entry.end_us >= since) spans.emplace_back(ring->thread, entry);
+				}
+			}
+		}
+		std::sort(spans.begin(), spans.end(), [](const auto& a, const auto& b) { return a.second.start_us < b.second.start_us; });
+
+		std::string json = R"({"displayTimeUnit":"ms","traceEvents":[)";
+		bool first = true;
+		for (const auto& [thread, entry] : spans) {
+			if (!first) json += ',';
+			first = false;
+			json += R"({"name":)";
+			AppendJsonString(json, entry.name);
+			json += std::format(R"(,"cat":"proxy","ph":"X","pid":1,"tid":{},"ts":{},"dur":{},"args":{{"request":{})",
+				thread, entry.start_us, entry.end_us - entry.start_us, entry.request);
+			if (entry.detail[0] != '\0') {
+				json += R"(,"detail":)";
+				AppendJsonString(json, entry.detail);
+			}
+			json += "}}";
+		}
+		json += "]}";
+		return json;
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <crow/http_request.h>
+#include <crow/http_response.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace direct_output_proxy {
+	// Spans kept per thread. Older spans are overwritten.
+	constexpr size_t kTraceRingSize = 4096;
+
+	// Sampled request tracing. A traced request gets an ID, which follows it to other threads through
+	// TraceRequestScope, and every TraceSpan entered on its behalf is stored in a ring buffer of the thread.
+	// Spans of requests which are not traced cost one thread_local read.
+
+	// Traces one in `one_in` requests. 0 turns tracing off, which is the default.
+	void SetTraceSampling(uint32_t one_in);
+
+	// Decides whether a new request is traced. Returns its ID, or 0 if it's not traced.
+	uint64_t BeginTraceRequest();
+
+	// The request the current thread works on, 0 if none or not traced.
+	uint64_t GetTraceRequest();
+	void SetTraceRequest(uint64_t request);
+
+	// Microseconds since the tracer started.
+	int64_t TraceNow();
+
+	// Stores a span of the current request, if it's traced. Names must be string literals.
+	void RecordTraceSpan(const char* name, int64_t start_us, int64_t end_us, std::string_view detail = {});
+
+	// Chrome trace event JSON of the spans which ended in the last `seconds`, for chrome://tracing or Perfetto.
+	std::string ExportTrace(int seconds);
+
+	// Makes the current thread work on `request` while in scope.
+	class TraceRequestScope {
+	public:
+		explicit TraceRequestScope(const uint64_t request) : previous_(GetTraceRequest()) {
+			SetTraceRequest(request);
+		}
+		~TraceRequestScope() {
+			SetTraceRequest(previous_);
+		}
+	private:
+		uint64_t previous_;
+	};
+
+	// Records the time until it goes out of scope as a span of the current request.
+	class TraceSpan {
+	public:
+		explicit TraceSpan(const char* name)
+			: name_(name), traced_(GetTraceRequest() != 0), start_(traced_ ? TraceNow() : 0) {
+		}
+		~TraceSpan() {
+			if (traced_) RecordTraceSpan(name_, start_, TraceNow());
+		}
+	private:
+		const char* name_;
+		bool traced_;
+		int64_t start_;
+	};
+
+	// Crow middleware which decides whether a request is traced, and records the whole request as a span.
+	struct TracingMiddleware {
+		struct context {
+			uint64_t request = 0;
+			int64_t start = 0;
+		};
+
+		void before_handle(crow::request& req, crow::response& res, context& ctx) {
+			ctx.request = BeginTraceRequest();
+			if (ctx.request == 0) return;
+			ctx.start = TraceNow();
+			SetTraceRequest(ctx.request);
+		}
+
+		void after_handle(crow::request& req, crow::response& res, context& ctx) {
+			if (ctx.request == 0) return;
+			RecordTraceSpan("request", ctx.start, TraceNow(), req.raw_url);
+			SetTraceRequest(0);
+		}
+	};
+}
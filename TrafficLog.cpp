@@ -0,0 +1,322 @@
+#include "TrafficLog.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <Windows.h>
+#include "EventSubscriptions.h"
+#include "types.h"
+#include "utils.h"
+
+namespace direct_output_proxy {
+	namespace {
+		// The headers which routes read, so replay needs them.
+		constexpr const char* kRecordedHeaders[] = { "If-Match", "X-Client-Id" };
+
+		void AppendU8(std::string& out, const uint8_t value) {
+			out.push_back(static_cast<char>(value));
+		}
+
+		void AppendU32(std::string& out, const uint32_t value) {
+			for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+		}
+
+		void AppendU64(std::string& out, const uint64_t value) {
+			AppendU32(out, static_cast<uint32_t>(value));
+			AppendU32(out, static_cast<uint32_t>(value >> 32));
+		}
+
+		void AppendString(std::string& out, const std::string& value) {
+			AppendU32(out, static_cast<uint32_t>(value.size()));
+			out += value;
+		}
+
+		// As UTF-16 code units.
+		void AppendWideString(std::string& out, const std::wstring& value) {
+			AppendU32(out, static_cast<uint32_t>(value.size()));
+			for (const wchar_t c : value) {
+				out.push_back(static_cast<char>(c & 0xff));
+				out.push_back(static_cast<char>((c >> 8) & 0xff));
+			}
+		}
+
+		// Reads little endian integers from a payload, failing once it runs out of bytes.
+		class PayloadReader {
+		public:
+			explicit PayloadReader(const std::string& payload) : payload_(payload) {
+			}
+
+			bool ReadU8(uint8_t* value) {
+				if (pos_ + 1 > payload_.size()) return false;
+				*value = static_cast<uint8_t>(payload_[pos_++]);
+				return true;
+			}
+
+			bool ReadU32(uint32_t* value) {
+				if (pos_ + 4 > payload_.size()) return false;
+				*value = 0;
+				for (int i = 0; i < 4; ++i) *value |= static_cast<uint32_t>(static_cast<uint8_t>(payload_[pos_++])) << (8 * i);
+				return true;
+			}
+
+			bool ReadU64(uint64_t* value) {
+				uint32_t low, high;
+				if (!ReadU32(&low) || !ReadU32(&high)) return false;
+				*value = (static_cast<uint64_t>(high) << 32) | low;
+				return true;
+			}
+
+			bool ReadString(std::string* value) {
+				uint32_t size;
+				if (!ReadU32(&size) || pos_ + size > payload_.size()) return false;
+				*value = payload_.substr(pos_, size);
+				pos_ += size;
+				return true;
+			}
+
+			bool ReadWideString(std::wstring* value) {
+				uint32_t size;
+				if (!ReadU32(&size) || pos_ + 2 * static_cast<size_t>(size) > payload_.size()) return false;
+				value->resize(size);
+				for (uint32_t i = 0; i < size; ++i) {
+					(*value)[i] = static_cast<wchar_t>(static_cast<uint8_t>(payload_[pos_]) | (static_cast<uint8_t>(payload_[pos_ + 1]) << 8));
+					pos_ += 2;
+				}
+				return true;
+			}
+
+			std::string Rest() {
+				std::string rest = payload_.substr(pos_);
+				pos_ = payload_.size();
+				return rest;
+			}
+		private:
+			const std::string& payload_;
+			size_t pos_ = 0;
+		};
+	}
+
+	bool TrafficRecorder::Open(const std::wstring& path) {
+		std::lock_guard lock(mutex_);
+		out_.open(std::filesystem::path(path), std::ios::binary | std::ios::trunc);
+		if (!out_) return false;
+		out_.write(kTrafficLogMagic, sizeof(kTrafficLogMagic));
+		last_record_ = std::chrono::steady_clock::now();
+		open_ = true;
+		return true;
+	}
+
+	void TrafficRecorder::Close() {
+		std::lock_guard lock(mutex_);
+		if (!open_) return;
+		out_.close();
+		open_ = false;
+	}
+
+	void TrafficRecorder::Write(const TrafficRecordType type, const std::string& payload) {
+		std::lock_guard lock(mutex_);
+		if (!open_) return;
+		if (payload.size() > kMaxTrafficRecordSize) {
+			Debug() << "record: dropped a record of " << payload.size() << " bytes" << std::endl;
+			return;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - last_record_).count();
+		last_record_ = now;
+
+		std::string header;
+		AppendU8(header, static_cast<uint8_t>(type));
+		AppendU32(header, static_cast<uint32_t>(std::clamp<long long>(delta, 0, UINT32_MAX)));
+		AppendU32(header, static_cast<uint32_t>(payload.size()));
+		out_.write(header.data(), header.size());
+		out_.write(payload.data(), payload.size());
+	}
+
+	void TrafficRecorder::BeginHttpRequest(const crow::request& req) {
+		const uint32_t concurrency = ++http_in_flight_;
+		std::string payload;
+		AppendU8(payload, static_cast<uint8_t>(req.method));
+		AppendU32(payload, concurrency);
+		AppendString(payload, req.raw_url);
+		AppendString(payload, req.remote_ip_address);
+		std::vector<std::pair<std::string, std::string>> headers;
+		for (const char* name : kRecordedHeaders) {
+			auto [begin, end] = req.headers.equal_range(name);
+			for (auto it = begin; it != end; ++it) headers.emplace_back(it->first, it->second);
+		}
+		AppendU32(payload, static_cast<uint32_t>(headers.size()));
+		for (const auto& [name, value] : headers) {
+			AppendString(payload, name);
+			AppendString(payload, value);
+		}
+		payload += req.body;
+		Write(TrafficRecordType::kHttpRequest, payload);
+	}
+
+	void TrafficRecorder::EndHttpRequest() {
+		--http_in_flight_;
+	}
+
+	void TrafficRecorder::RecordWebSocketOpen(const uint64_t connection, const EventFilter& filter) {
+		std::string payload;
+		AppendU64(payload, connection);
+		AppendU32(payload, filter.devices);
+		AppendU64(payload, filter.pages);
+		for (const DWORD buttons : filter.buttons) AppendU32(payload, buttons);
+		AppendU32(payload, filter.kinds);
+		AppendU8(payload, static_cast<uint8_t>(filter.encoding));
+		Write(TrafficRecordType::kWebSocketOpen, payload);
+	}
+
+	void TrafficRecorder::RecordWebSocketMessage(const uint64_t connection, const std::string& message) {
+		std::string payload;
+		AppendU64(payload, connection);
+		payload += message;
+		Write(TrafficRecordType::kWebSocketMessage, payload);
+	}
+
+	void TrafficRecorder::RecordWebSocketClose(const uint64_t connection) {
+		std::string payload;
+		AppendU64(payload, connection);
+		Write(TrafficRecordType::kWebSocketClose, payload);
+	}
+
+	void TrafficRecorder::RecordButtons(const DeviceType device, const DWORD buttons) {
+		std::string payload;
+		AppendU8(payload, static_cast<uint8_t>(device));
+		AppendU32(payload, buttons);
+		Write(TrafficRecordType::kButtons, payload);
+	}
+
+	void TrafficRecorder::RecordPage(const DeviceType device, const DWORD page, const bool activated) {
+		std::string payload;
+		AppendU8(payload, static_cast<uint8_t>(device));
+		AppendU32(payload, page);
+		AppendU8(payload, activated ? 1 : 0);
+		Write(TrafficRecordType::kPage, payload);
+	}
+
+	void TrafficRecorder::RecordDevice(const DeviceType device, const bool added) {
+		std::string payload;
+		AppendU8(payload, static_cast<uint8_t>(device));
+		AppendU8(payload, added ? 1 : 0);
+		Write(TrafficRecordType::kDevice, payload);
+	}
+
+	void TrafficRecorder::RecordIngress(const IngressCommand& command) {
+		std::string payload;
+		AppendU8(payload, static_cast<uint8_t>(command.channel));
+		AppendU8(payload, static_cast<uint8_t>(command.op));
+		AppendU8(payload, static_cast<uint8_t>(command.device));
+		AppendU32(payload, command.page);
+		AppendU32(payload, command.index);
+		AppendU32(payload, command.value);
+		AppendWideString(payload, command.content);
+		Write(TrafficRecordType::kIngress, payload);
+	}
+
+	bool TrafficLogReader::Open(const std::wstring& path) {
+		std::error_code ec;
+		size_ = std::filesystem::file_size(std::filesystem::path(path), ec);
+		if (ec) return false;
+		in_.open(std::filesystem::path(path), std::ios::binary);
+		char magic[sizeof(kTrafficLogMagic)];
+		return in_.read(magic, sizeof(magic)) && std::memcmp(magic, kTrafficLogMagic, sizeof(magic)) == 0;
+	}
+
+	bool TrafficLogReader::Next(TrafficRecord* record) {
+		char header[9];
+		if (!in_.read(header, sizeof(header))) return false;
+		std::string header_bytes(header, sizeof(header));
+		PayloadReader header_reader(header_bytes);
+		uint8_t type;
+		uint32_t delta, size;
+		header_reader.ReadU8(&type);
+		header_reader.ReadU32(&delta);
+		header_reader.ReadU32(&size);
+
+		// Checked before allocating, as a corrupt size could be anything.
+		const std::streamoff position = in_.tellg();
+		if (size > kMaxTrafficRecordSize || position < 0 || size > size_ - static_cast<uint64_t>(position)) return false;
+		std::string payload(size, '\0');
+		if (!in_.read(payload.data(), payload.size())) return false;
+
+		timestamp_ += std::chrono::microseconds(delta);
+		*record = TrafficRecord();
+		record->type = static_cast<TrafficRecordType>(type);
+		record->timestamp = timestamp_;
+
+		PayloadReader reader(payload);
+		uint8_t u8 = 0;
+		uint32_t u32 = 0;
+		switch (record->type) {
+		case TrafficRecordType::kHttpRequest: {
+			uint32_t headers = 0;
+			if (!reader.ReadU8(&u8) || !reader.ReadU32(&record->concurrency) || !reader.ReadString(&record->text) ||
+				!reader.ReadString(&record->remote_ip) || !reader.ReadU32(&headers)) return false;
+			record->method = static_cast<crow::HTTPMethod>(u8);
+			for (uint32_t i = 0; i < headers; ++i) {
+				std::pair<std::string, std::string> header;
+				if (!reader.ReadString(&header.first) || !reader.ReadString(&header.second)) return false;
+				record->headers.push_back(std::move(header));
+			}
+			record->body = reader.Rest();
+			return true;
+		}
+		case TrafficRecordType::kWebSocketOpen:
+			if (!reader.ReadU64(&record->connection) || !reader.ReadU32(&record->filter.devices) ||
+				!reader.ReadU64(&record->filter.pages)) return false;
+			for (DWORD& buttons : record->filter.buttons) {
+				if (!reader.ReadU32(&u32)) return false;
+				buttons = u32;
+			}
+			if (!reader.ReadU32(&record->filter.kinds) || !reader.ReadU8(&u8)) return false;
+			record->filter.encoding = static_cast<EventEncoding>(u8);
+			return true;
+		case TrafficRecordType::kWebSocketMessage:
+			if (!reader.ReadU64(&record->connection)) return false;
+			record->text = reader.Rest();
+			return true;
+		case TrafficRecordType::kWebSocketClose:
+			return reader.ReadU64(&record->connection);
+		case TrafficRecordType::kButtons:
+			if (!reader.ReadU8(&u8) || !reader.ReadU32(&u32)) return false;
+			record->device = static_cast<DeviceType>(u8);
+			record->value = u32;
+			return true;
+		case TrafficRecordType::kPage:
+			if (!reader.ReadU8(&u8) || !reader.ReadU32(&u32)) return false;
+			record->device = static_cast<DeviceType>(u8);
+			record->value = u32;
+			if (!reader.ReadU8(&u8)) return false;
+			record->flag = u8 != 0;
+			return true;
+		case TrafficRecordType::kDevice:
+			if (!reader.ReadU8(&u8)) return false;
+			record->device = static_cast<DeviceType>(u8);
+			if (!reader.ReadU8(&u8)) return false;
+			record->flag = u8 != 0;
+			return true;
+		case TrafficRecordType::kIngress: {
+			IngressCommand& command = record->ingress;
+			uint8_t op, device;
+			if (!reader.ReadU8(&u8) || !reader.ReadU8(&op) || !reader.ReadU8(&device) || !reader.ReadU32(&u32)) return false;
+			command.channel = static_cast<IngressChannel>(u8);
+			command.op = static_cast<IngressOp>(op);
+			command.device = static_cast<DeviceType>(device);
+			command.page = u32;
+			if (!reader.ReadU32(&u32)) return false;
+			command.index = u32;
+			if (!reader.ReadU32(&u32)) return false;
+			command.value = u32;
+			return reader.ReadWideString(&command.content);
+		}
+		}
+		return false;
+	}
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <crow/http_request.h>
+#include <crow/http_response.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <Windows.h>
+#include "EventSubscriptions.h"
+#include "types.h"
+
+namespace direct_output_proxy {
+	// File layout: the 8 byte kTrafficLogMagic, then records of
+	//   uint8 type (TrafficRecordType), uint32 microseconds since the previous record, uint32 payload size, payload.
+	// All integers are little endian, strings are prefixed with their uint32 size. The payload depends on the
+	// type, see TrafficRecorder.
+	constexpr char kTrafficLogMagic[8] = { 'D', 'O', 'P', 'X', 'L', 'O', 'G', '3' };
+	// Larger payloads are not recorded, and make a log corrupt.
+	constexpr uint32_t kMaxTrafficRecordSize = 16 << 20;
+
+	enum class TrafficRecordType : uint8_t {
+		kHttpRequest = 1,
+		kWebSocketOpen = 2,
+		kWebSocketMessage = 3,
+		kWebSocketClose = 4,
+		kButtons = 5,
+		kPage = 6,
+		kDevice = 7,
+		kIngress = 8,
+	};
+
+	// Where a write which didn't come over HTTP came from.
+	enum class IngressChannel : uint8_t {
+		kSharedMemory = 1,
+		kUdp = 2,
+	};
+
+	enum class IngressOp : uint8_t {
+		kAddPage = 1,
+		kRemovePage = 2,
+		kSetLine = 3,
+		kSetLed = 4,
+	};
+
+	// A write from shared memory or UDP, as passed to the handlers of the channel.
+	struct IngressCommand {
+		IngressChannel channel = IngressChannel::kSharedMemory;
+		IngressOp op = IngressOp::kSetLine;
+		DeviceType device = DeviceType::kUnknown;
+		DWORD page = 0;
+		// kSetLine: the line. kSetLed: the LED.
+		DWORD index = 0;
+		// kSetLed: the value. kAddPage: activate.
+		DWORD value = 0;
+		// kSetLine.
+		std::wstring content;
+	};
+
+	struct TrafficRecord {
+		TrafficRecordType type = TrafficRecordType::kHttpRequest;
+		// Since the first record.
+		std::chrono::microseconds timestamp{ 0 };
+
+		// kHttpRequest: the URL with the query string. kWebSocketMessage: the message.
+		std::string text;
+		// kHttpRequest.
+		crow::HTTPMethod method = crow::HTTPMethod::Get;
+		std::string remote_ip;
+		std::vector<std::pair<std::string, std::string>> headers;
+		std::string body;
+		// kHttpRequest: the requests being handled when it came in, including itself.
+		uint32_t concurrency = 1;
+		// kWebSocket*: identifies the connection within the log.
+		uint64_t connection = 0;
+		// kWebSocketOpen: the filter given when connecting.
+		EventFilter filter;
+
+		// kButtons, kPage, kDevice.
+		DeviceType device = DeviceType::kUnknown;
+		// kButtons: the pressed buttons. kPage: the page.
+		DWORD value = 0;
+		// kPage: activated. kDevice: added.
+		bool flag = false;
+
+		// kIngress.
+		IngressCommand ingress;
+	};
+
+	// Writes every command coming into the proxy, and every device callback, to a log for TrafficReplay.
+	// Thread-safe. Recording methods do nothing until Open() succeeded.
+	class TrafficRecorder {
+	public:
+		bool Open(const std::wstring& path);
+		void Close();
+
+		// Records the method, URL, client address, the headers the routes read and the body, and counts the request
+		// as being handled until EndHttpRequest(). Other headers, e.g. Authorization or cookies, are not recorded.
+		void BeginHttpRequest(const crow::request& req);
+		void EndHttpRequest();
+		void RecordWebSocketOpen(uint64_t connection, const EventFilter& filter);
+		void RecordWebSocketMessage(uint64_t connection, const std::string& message);
+		void RecordWebSocketClose(uint64_t connection);
+		void RecordButtons(DeviceType device, DWORD buttons);
+		void RecordPage(DeviceType device, DWORD page, bool activated);
+		void RecordDevice(DeviceType device, bool added);
+		void RecordIngress(const IngressCommand& command);
+	private:
+		void Write(TrafficRecordType type, const std::string& payload);
+
+		std::atomic<uint32_t> http_in_flight_ = 0;
+
+		std::mutex mutex_;
+		std::ofstream out_;
+		bool open_ = false;
+		std::chrono::steady_clock::time_point last_record_;
+	};
+
+	class TrafficLogReader {
+	public:
+		bool Open(const std::wstring& path);
+
+		// Reads the next record. Returns false at the end of the log, or if the log is corrupt.
+		bool Next(TrafficRecord* record);
+	private:
+		std::ifstream in_;
+		// Of the file.
+		uint64_t size_ = 0;
+		std::chrono::microseconds timestamp_{ 0 };
+	};
+
+	// Crow middleware which records every HTTP request.
+	struct RecordingMiddleware {
+		struct context {
+			bool recorded = false;
+		};
+
+		void before_handle(crow::request& req, crow::response& res, context& ctx) {
+			if (recorder == nullptr) return;
+			recorder->BeginHttpRequest(req);
+			ctx.recorded = true;
+		}
+
+		void after_handle(crow::request& req, crow::response& res, context& ctx) {
+			if (ctx.recorded) recorder->EndHttpRequest();
+		}
+
+		TrafficRecorder* recorder = nullptr;
+	};
+}
@@ -0,0 +1,269 @@
+#include "TrafficReplay.h"
+
+#include <algorithm>
+#include <format>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Windows.h>
+#include "FakeDirectOutput.h"
+#include "utils.h"
+
+namespace direct_output_proxy {
+	namespace {
+		const char* RecordCategory(const TrafficRecordType type) {
+			switch (type) {
+			case TrafficRecordType::kHttpRequest:
+				return "http";
+			case TrafficRecordType::kWebSocketOpen:
+			case TrafficRecordType::kWebSocketMessage:
+			case TrafficRecordType::kWebSocketClose:
+				return "websocket";
+			case TrafficRecordType::kIngress:
+				return "ingress";
+			default:
+				return "device";
+			}
+		}
+
+		// Formats p50, p99 and max of the latencies, which are sorted in place.
+		std::string FormatLatencies(std::vector<double>& latencies_us) {
+			if (latencies_us.empty()) return "none";
+			std::sort(latencies_us.begin(), latencies_us.end());
+			auto percentile = [&latencies_us](const double p) {
+				return latencies_us[static_cast<size_t>(p * (latencies_us.size() - 1))];
+			};
+			return std::format("n {}, p50 {:.0f}us, p99 {:.0f}us, max {:.0f}us",
+				latencies_us.size(), percentile(0.5), percentile(0.99), latencies_us.back());
+		}
+	}
+
+	// Stands in for a client socket. Nothing is sent anywhere, messages are only counted.
+	class TrafficReplay::ReplayConnection : public crow::websocket::connection {
+	public:
+		explicit ReplayConnection(std::atomic<uint64_t>* messages_sent) : messages_sent_(messages_sent) {
+		}
+
+		void send_binary(std::string msg) override {
+			++*messages_sent_;
+		}
+
+		void send_text(std::string msg) override {
+			++*messages_sent_;
+		}
+
+		void send_ping(std::string msg) override {
+		}
+
+		void send_pong(std::string msg) override {
+		}
+
+		void close(std::string const& msg, uint16_t status_code) override {
+		}
+
+		std::string get_remote_ip() override {
+			return "replay";
+		}
+
+		std::string get_subprotocol() const override {
+			return "";
+		}
+	private:
+		std::atomic<uint64_t>* messages_sent_;
+	};
+
+	TrafficReplay::TrafficReplay(ProxyApp& app, EventSubscriptions& subscriptions, SharedMemoryHandlers shm_handlers,
+		UdpIngressHandlers udp_handlers)
+		: app_(app), subscriptions_(subscriptions), shm_handlers_(std::move(shm_handlers)), udp_handlers_(std::move(udp_handlers)) {
+	}
+
+	TrafficReplay::~TrafficReplay() {
+		for (const auto& [id, conn] : connections_) subscriptions_.Remove(conn.get());
+	}
+
+	std::string TrafficReplay::Run(TrafficLogReader& reader, const double speed) {
+		uint64_t records = 0;
+		const uint64_t calls_before = FakeDirectOutput::GetCallCount();
+		measure_lag_ = speed > 0;
+		for (uint32_t i = 0; i < kReplayWorkers; ++i) workers_.emplace_back(&TrafficReplay::RunWorker, this);
+
+		const Clock::time_point start = Clock::now();
+		TrafficRecord record;
+		while (reader.Next(&record)) {
+			Clock::time_point due = start;
+			if (speed > 0) {
+				due += std::chrono::duration_cast<Clock::duration>(record.timestamp / speed);
+				std::this_thread::sleep_until(due);
+			}
+			++records;
+
+			if (record.type == TrafficRecordType::kHttpRequest) {
+				const uint32_t concurrency = std::clamp(record.concurrency, 1u, kReplayWorkers);
+				std::unique_lock lock(mutex_);
+				done_cv_.wait(lock, [this, concurrency]() { return in_flight_ < concurrency; });
+				++in_flight_;
+				queue_.push_back({ .record = std::move(record), .due = due });
+				queued_cv_.notify_one();
+				continue;
+			}
+
+			// The other sources were handled by one thread each, so they keep their order.
+			const Clock::time_point begin = Clock::now();
+			Dispatch(record);
+			Measure(record.type, due, begin, Clock::now());
+		}
+
+		{
+			std::unique_lock lock(mutex_);
+			done_cv_.wait(lock, [this]() { return in_flight_ == 0; });
+			stopping_ = true;
+		}
+		queued_cv_.notify_all();
+		for (std::thread& worker : workers_) worker.join();
+		workers_.clear();
+		const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+		std::string report = std::format("replayed {} records in {:.3f}s ({:.0f} records/s), {} skipped",
+			records, seconds, seconds > 0 ? records / seconds : 0.0, skipped_.load());
+		for (auto& [category, category_latencies] : latencies_us_) {
+			report += std::format("\n{}: {}", category, FormatLatencies(category_latencies));
+		}
+		report += std::format("\nevents sent: {}", messages_sent_.load());
+		report += std::format("\nsdk calls: {}", FakeDirectOutput::GetCallCount() - calls_before);
+		if (speed > 0) report += std::format("\nmax lag behind schedule: {:.0f}us", max_lag_us_);
+		Debug() << report << std::endl;
+		return report;
+	}
+
+	void TrafficReplay::RunWorker() {
+		std::unique_lock lock(mutex_);
+		while (true) {
+			queued_cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+			if (queue_.empty()) return;
+			HttpJob job = std::move(queue_.front());
+			queue_.pop_front();
+			lock.unlock();
+
+			const Clock::time_point begin = Clock::now();
+			DispatchHttp(job.record);
+			Measure(job.record.type, job.due, begin, Clock::now());
+
+			lock.lock();
+			--in_flight_;
+			done_cv_.notify_all();
+		}
+	}
+
+	void TrafficReplay::Measure(const TrafficRecordType type, const Clock::time_point due, const Clock::time_point begin,
+		const Clock::time_point end) {
+		std::lock_guard lock(mutex_);
+		latencies_us_[RecordCategory(type)].push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+		if (measure_lag_) max_lag_us_ = std::max(max_lag_us_, std::chrono::duration<double, std::micro>(begin - due).count());
+	}
+
+	void TrafficReplay::DispatchHttp(const TrafficRecord& record) {
+		const std::string path = record.text.substr(0, record.text.find('?'));
+		// Stopping the app would end the replay, and websockets are replayed from their own records.
+		if (path == "/exit" || path == "/events") {
+			++skipped_;
+			return;
+		}
+		crow::request req;
+		req.method = record.method;
+		req.raw_url = record.text;
+		req.url = path;
+		req.url_params = crow::query_string(record.text);
+		for (const auto& [name, value] : record.headers) req.headers.emplace(name, value);
+		req.body = record.body;
+		req.remote_ip_address = record.remote_ip;
+		crow::response res;
+		app_.handle_full(req, res);
+	}
+
+	void TrafficReplay::DispatchIngress(const IngressCommand& command) {
+		if (command.channel == IngressChannel::kUdp) {
+			switch (command.op) {
+			case IngressOp::kSetLine:
+				if (udp_handlers_.set_line) udp_handlers_.set_line(command.device, command.page, static_cast<LineIndex>(command.index), command.content);
+				return;
+			case IngressOp::kSetLed:
+				if (udp_handlers_.set_led) udp_handlers_.set_led(command.device, command.page, command.index, command.value);
+				return;
+			default:
+				break;
+			}
+		} else {
+			switch (command.op) {
+			case IngressOp::kAddPage:
+				if (shm_handlers_.add_page) shm_handlers_.add_page(command.page, command.value != 0);
+				return;
+			case IngressOp::kRemovePage:
+				if (shm_handlers_.remove_page) shm_handlers_.remove_page(command.page);
+				return;
+			case IngressOp::kSetLine:
+				if (shm_handlers_.set_line) shm_handlers_.set_line(command.page, command.index, command.content);
+				return;
+			case IngressOp::kSetLed:
+				if (shm_handlers_.set_led) shm_handlers_.set_led(command.page, command.index, command.value);
+				return;
+			}
+		}
+		++skipped_;
+	}
+
+	void TrafficReplay::Dispatch(const TrafficRecord& record) {
+		switch (record.type) {
+		case TrafficRecordType::kHttpRequest:
+			DispatchHttp(record);
+			return;
+		case TrafficRecordType::kWebSocketOpen: {
+			auto conn = std::make_unique<ReplayConnection>(&messages_sent_);
+			subscriptions_.Add(conn.get(), record.filter);
+			auto previous = connections_.find(record.connection);
+			if (previous != connections_.end()) subscriptions_.Remove(previous->second.get());
+			connections_[record.connection] = std::move(conn);
+			return;
+		}
+		case TrafficRecordType::kWebSocketMessage: {
+			auto it = connections_.find(record.connection);
+			if (it == connections_.end()) {
+				++skipped_;
+				return;
+			}
+			EventFilter filter;
+			std::optional<std::string> error = ParseFilterMessage(record.text, &filter);
+			if (error.has_value()) {
+				it->second->send_text("error: " + error.value());
+				return;
+			}
+			subscriptions_.Update(it->second.get(), filter);
+			it->second->send_text("ok");
+			return;
+		}
+		case TrafficRecordType::kWebSocketClose: {
+			auto it = connections_.find(record.connection);
+			if (it == connections_.end()) {
+				++skipped_;
+				return;
+			}
+			subscriptions_.Remove(it->second.get());
+			connections_.erase(it);
+			return;
+		}
+		case TrafficRecordType::kButtons:
+			FakeDirectOutput::InjectButtons(record.device, record.value);
+			return;
+		case TrafficRecordType::kPage:
+			FakeDirectOutput::InjectPage(record.device, record.value, record.flag);
+			return;
+		case TrafficRecordType::kDevice:
+			FakeDirectOutput::InjectDevice(record.device, record.flag);
+			return;
+		case TrafficRecordType::kIngress:
+			DispatchIngress(record.ingress);
+			return;
+		}
+		++skipped_;
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <crow/websocket.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EventSubscriptions.h"
+#include "ProxyApp.h"
+#include "SharedMemoryChannel.h"
+#include "TrafficLog.h"
+#include "UdpIngress.h"
+
+namespace direct_output_proxy {
+	// Requests handled at the same time during a replay at most.
+	constexpr uint32_t kReplayWorkers = 16;
+
+	// Plays a traffic log back against an app whose proxy uses FakeDirectOutput, reporting how fast the proxy
+	// kept up. HTTP requests go through the app's routes without a socket, on worker threads like the server's,
+	// /events clients are stand-in connections which count what they are sent, shared memory and UDP writes go
+	// to the handlers of their channel, and device callbacks are injected into the fake.
+	class TrafficReplay {
+	public:
+		TrafficReplay(ProxyApp& app, EventSubscriptions& subscriptions, SharedMemoryHandlers shm_handlers,
+			UdpIngressHandlers udp_handlers);
+		~TrafficReplay();
+
+		// Replays every record of the log. `speed` 1 keeps the recorded timing, 10 is ten times faster, and 0
+		// replays as fast as possible. At any speed, an HTTP request waits until fewer requests are being handled
+		// than when it was recorded, so requests which ran one after the other still do. Returns a summary of
+		// latencies and throughput.
+		std::string Run(TrafficLogReader& reader, double speed);
+	private:
+		class ReplayConnection;
+
+		using Clock = std::chrono::steady_clock;
+
+		struct HttpJob {
+			TrafficRecord record;
+			Clock::time_point due;
+		};
+
+		// Runs queued HTTP requests until stopped.
+		void RunWorker();
+
+		// Records the latency of a record, and how late it was started.
+		void Measure(TrafficRecordType type, Clock::time_point due, Clock::time_point begin, Clock::time_point end);
+
+		void Dispatch(const TrafficRecord& record);
+		void DispatchHttp(const TrafficRecord& record);
+		void DispatchIngress(const IngressCommand& command);
+
+		ProxyApp& app_;
+		EventSubscriptions& subscriptions_;
+		SharedMemoryHandlers shm_handlers_;
+		UdpIngressHandlers udp_handlers_;
+		std::map<uint64_t, std::unique_ptr<ReplayConnection>> connections_;
+		std::atomic<uint64_t> skipped_ = 0;
+		std::atomic<uint64_t> messages_sent_ = 0;
+
+		std::vector<std::thread> workers_;
+		std::mutex mutex_;
+		// Signals queued requests, and stopping.
+		std::condition_variable queued_cv_;
+		// Signals finished requests.
+		std::condition_variable done_cv_;
+		std::deque<HttpJob> queue_;
+		// Queued or running.
+		uint32_t in_flight_ = 0;
+		bool stopping_ = false;
+		bool measure_lag_ = false;
+		std::map<std::string, std::vector<double>> latencies_us_;
+		double max_lag_us_ = 0;
+	};
+}
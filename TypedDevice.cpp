@@ -0,0 +1,15 @@
+#include "TypedDevice.h"
+
+namespace direct_output_proxy {
+	std::unique_ptr<DirectOutputDevice> MakeDevice(const DeviceType type, CDirectOutput* direct_output, void* handle,
+		SdkEventDispatcher* events) {
+		switch (type) {
+		case DeviceType::kX52Pro:
+			return std::make_unique<TypedDevice<DeviceTraits<DeviceType::kX52Pro>>>(direct_output, handle, events);
+		case DeviceType::kFip:
+			return std::make_unique<TypedDevice<DeviceTraits<DeviceType::kFip>>>(direct_output, handle, events);
+		default:
+			return std::make_unique<TypedDevice<DeviceTraits<DeviceType::kUnknown>>>(direct_output, handle, events);
+		}
+	}
+}
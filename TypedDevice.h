@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "DeviceTraits.h"
+#include "DirectOutputDevice.h"
+#include "utils.h"
+
+namespace direct_output_proxy {
+	// A device whose type is known at compile time, so writing a page only does what the device supports,
+	// and lines are cut to the width of its display. Requests are checked against the traits as well.
+	template <typename Traits>
+	class TypedDevice : public DirectOutputDevice {
+	public:
+		static_assert(Traits::kLines <= kBottomLine + 1, "PageData holds three lines");
+
+		static constexpr DeviceCaps kCaps = MakeDeviceCaps<Traits>();
+
+		TypedDevice(CDirectOutput* direct_output, void* handle, SdkEventDispatcher* events)
+			: DirectOutputDevice(direct_output, handle, events, kCaps) {
+		}
+
+		~TypedDevice() override {
+			StopExecutor();
+		}
+	protected:
+		HRESULT WriteContent(const DWORD slot, const PageData& data) override {
+			if constexpr (Traits::kLines > 0) {
+				const std::wstring* lines[] = { &data.top, &data.middle, &data.bottom };
+				for (DWORD line = 0; line < Traits::kLines; ++line) {
+					CHECK_RETURN("SetString", SdkSetString(slot, static_cast<LineIndex>(line), lines[line]->substr(0, Traits::kLineWidth)));
+				}
+			}
+			if constexpr (Traits::kHasImage) {
+				if (!data.image.empty()) RETURN_IF_ERROR(DisplayImage(slot, data.image));
+			}
+			return S_OK;
+		}
+
+		HRESULT WriteLine(const DWORD slot, const LineIndex line, const std::wstring& content) override {
+			if constexpr (Traits::kLines > 0) {
+				if (line >= Traits::kLines) return E_INVALIDARG;
+				return SdkSetString(slot, line, content.substr(0, Traits::kLineWidth));
+			} else {
+				return E_INVALIDARG;
+			}
+		}
+
+		bool HasLine(const LineIndex line) const override {
+			return static_cast<DWORD>(line) < Traits::kLines;
+		}
+
+		bool HasColumn(const DWORD column) const override {
+			return column < Traits::kLineWidth;
+		}
+
+		bool HasLed(const DWORD index) const override {
+			return std::find(Traits::kLeds.begin(), Traits::kLeds.end(), index) != Traits::kLeds.end();
+		}
+
+		bool HasImage() const override {
+			return Traits::kHasImage;
+		}
+	};
+
+	// Creates the device implementation for the type of the device.
+	std::unique_ptr<DirectOutputDevice> MakeDevice(DeviceType type, CDirectOutput* direct_output, void* handle,
+		SdkEventDispatcher* events);
+}
@@ -0,0 +1,193 @@
+#include "UdpIngress.h"
+
+#include <cstring>
+#include <format>
+#include <optional>
+#include <string>
+
+#include <Windows.h>
+#include "types.h"
+#include "utils.h"
+
+namespace direct_output_proxy {
+	namespace {
+		// Senders which are tracked at most. The least recently seen sender is forgotten to make room.
+		constexpr size_t kMaxSources = 256;
+
+		uint16_t ReadU16(const uint8_t* data) {
+			return static_cast<uint16_t>(data[0] | (data[1] << 8));
+		}
+
+		uint32_t ReadU32(const uint8_t* data) {
+			return static_cast<uint32_t>(data[0]) | (static_cast<uint32_t>(data[1]) << 8) |
+				(static_cast<uint32_t>(data[2]) << 16) | (static_cast<uint32_t>(data[3]) << 24);
+		}
+
+		// Returns the device type with the value `value`, unless it's no device the proxy drives.
+		std::optional<DeviceType> ReadDeviceType(const uint8_t value) {
+			for (const DeviceType type : { DeviceType::kX52Pro, DeviceType::kFip }) {
+				if (static_cast<uint8_t>(type) == value) return type;
+			}
+			return std::nullopt;
+		}
+	}
+
+	UdpIngress::UdpIngress(UdpIngressHandlers handlers) : handlers_(std::move(handlers)) {
+	}
+
+	UdpIngress::~UdpIngress() {
+		Stop();
+	}
+
+	bool UdpIngress::Start(const uint16_t port) {
+		asio::error_code ec;
+		socket_.open(asio::ip::udp::v4(), ec);
+		if (!ec) socket_.bind(asio::ip::udp::endpoint(asio::ip::udp::v4(), port), ec);
+		if (ec) {
+			Debug() << "udp: failed to listen on " << port << ": " << ec.message() << std::endl;
+			return false;
+		}
+
+		applier_ = std::thread([this]() {
+			ApplyLoop();
+		});
+		Receive();
+		thread_ = std::thread([this]() {
+			io_context_.run();
+		});
+		return true;
+	}
+
+	void UdpIngress::Stop() {
+		if (!thread_.joinable()) return;
+		asio::post(io_context_, [this]() {
+			asio::error_code ec;
+			socket_.close(ec);
+		});
+		io_context_.stop();
+		thread_.join();
+
+		{
+			std::lock_guard lock(pending_mutex_);
+			stopping_ = true;
+		}
+		pending_cv_.notify_one();
+		applier_.join();
+	}
+
+	void UdpIngress::ApplyLoop() {
+		std::unique_lock lock(pending_mutex_);
+		while (true) {
+			pending_cv_.wait(lock, [this]() { return stopping_ || !pending_.empty(); });
+			if (stopping_) return;
+
+			std::map<UpdateKey, Update> updates;
+			updates.swap(pending_);
+			lock.unlock();
+			for (const auto& [key, update] : updates) {
+				if (key.kind == UdpKind::kLine) {
+					if (handlers_.set_line) handlers_.set_line(key.device, key.page, static_cast<LineIndex>(key.index), update.content);
+				} else {
+					if (handlers_.set_led) handlers_.set_led(key.device, key.page, key.index, update.value);
+				}
+			}
+			lock.lock();
+		}
+	}
+
+	void UdpIngress::Receive() {
+		socket_.async_receive_from(asio::buffer(buffer_), sender_, [this](const asio::error_code& ec, const size_t size) {
+			if (ec == asio::error::operation_aborted) return;
+			if (!ec) {
+				HandleDatagram(sender_.address().to_string() + ":" + std::to_string(sender_.port()), buffer_.data(), size);
+			}
+			Receive();
+		});
+	}
+
+	UdpIngress::SourceStats& UdpIngress::GetSourceStats(const std::string& source) {
+		auto it = sources_.find(source);
+		if (it != sources_.end()) return it->second;
+
+		if (sources_.size() >= kMaxSources) {
+			auto oldest = sources_.begin();
+			for (auto candidate = sources_.begin(); candidate != sources_.end(); ++candidate) {
+				if (candidate->second.last_seen < oldest->second.last_seen) oldest = candidate;
+			}
+			sources_.erase(oldest);
+		}
+		return sources_[source];
+	}
+
+	void UdpIngress::HandleDatagram(const std::string& source, const uint8_t* data, const size_t size) {
+		const bool valid_header = size >= kUdpHeaderSize && ReadU16(data) == kUdpMagic && data[2] == kUdpVersion &&
+			kUdpHeaderSize + ReadU16(data + 6) == size;
+		const UdpKind kind = valid_header ? static_cast<UdpKind>(data[3]) : UdpKind{};
+		const std::optional<DeviceType> device = valid_header ? ReadDeviceType(data[4]) : std::nullopt;
+		const uint8_t index = valid_header ? data[5] : 0;
+		const size_t payload_size = size - kUdpHeaderSize;
+		const uint8_t* payload = data + kUdpHeaderSize;
+
+		bool valid = valid_header && device.has_value();
+		switch (kind) {
+		case UdpKind::kLine:
+			valid = valid && index <= kBottomLine && payload_size % 2 == 0;
+			break;
+		case UdpKind::kLed:
+			valid = valid && payload_size == 4;
+			break;
+		default:
+			valid = false;
+			break;
+		}
+
+		{
+			std::lock_guard lock(stats_mutex_);
+			SourceStats& stats = GetSourceStats(source);
+			stats.last_seen = ++datagrams_;
+			if (!valid) {
+				++stats.malformed;
+				return;
+			}
+
+			const uint32_t sequence = ReadU32(data + 12);
+			if (stats.accepted > 0 && sequence != 0 && static_cast<int32_t>(sequence - stats.last_sequence) <= 0) {
+				++stats.dropped;
+				return;
+			}
+			stats.last_sequence = sequence;
+			++stats.accepted;
+		}
+
+		Update update;
+		if (kind == UdpKind::kLine) {
+			update.content.reserve(payload_size / 2);
+			for (size_t i = 0; i < payload_size; i += 2) {
+				update.content.push_back(static_cast<wchar_t>(ReadU16(payload + i)));
+			}
+		} else {
+			update.value = ReadU32(payload);
+		}
+
+		{
+			std::lock_guard lock(pending_mutex_);
+			const UpdateKey key = { .device = *device, .page = ReadU32(data + 8), .kind = kind, .index = index };
+			if (!pending_.insert_or_assign(key, std::move(update)).second) ++coalesced_;
+		}
+		pending_cv_.notify_one();
+	}
+
+	std::string UdpIngress::GetInfo() {
+		std::lock_guard lock(stats_mutex_);
+		std::string info = "udp sources: " + std::to_string(sources_.size());
+		{
+			std::lock_guard pending_lock(pending_mutex_);
+			info += std::format(", coalesced {}", coalesced_);
+		}
+		for (const auto& [source, stats] : sources_) {
+			info += std::format("\n{}: accepted {}, dropped {}, malformed {}, last sequence {}",
+				source, stats.accepted, stats.dropped, stats.malformed, stats.last_sequence);
+		}
+		return info;
+	}
+}
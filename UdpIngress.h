@@ -0,0 +1,108 @@
+#pragma once
+
+#include <asio.hpp>
+
+#include <array>
+#include <compare>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <Windows.h>
+#include "types.h"
+
+namespace direct_output_proxy {
+	// Datagram layout, all fields little endian:
+	//   uint16 magic (kUdpMagic), uint8 version (kUdpVersion), uint8 kind (UdpKind), uint8 device (DeviceType),
+	//   uint8 index (line or LED index), uint16 payload length in bytes, uint32 page, uint32 sequence,
+	//   then the payload: UTF-16 characters for lines, an uint32 value for LEDs.
+	constexpr uint16_t kUdpMagic = 0x5544;  // "DU"
+	constexpr uint8_t kUdpVersion = 1;
+	constexpr size_t kUdpHeaderSize = 16;
+	constexpr size_t kMaxDatagramSize = 512;
+
+	enum class UdpKind : uint8_t {
+		kLine = 1,
+		kLed = 2,
+	};
+
+	struct UdpIngressHandlers {
+		std::function<void(DeviceType device, DWORD page, LineIndex line, const std::wstring& content)> set_line;
+		std::function<void(DeviceType device, DWORD page, DWORD index, DWORD value)> set_led;
+	};
+
+	// Optional UDP listener for high rate, loss tolerant updates, e.g. gauges and counters.
+	// Every sender (address and port) numbers its datagrams. Datagrams which are not newer than the last accepted
+	// one from the same sender are dropped, so a late datagram never overwrites a newer value. Sequence 0 restarts
+	// the numbering, for senders which restarted.
+	// Accepted updates are applied by a separate thread, so a slow device doesn't hold up receiving. Updates of the
+	// same line or LED which arrive while the thread is busy are coalesced; only the latest one is applied.
+	class UdpIngress {
+	public:
+		explicit UdpIngress(UdpIngressHandlers handlers);
+		~UdpIngress();
+
+		bool Start(uint16_t port);
+		void Stop();
+
+		// Returns the counters of each sender.
+		std::string GetInfo();
+	private:
+		struct SourceStats {
+			uint32_t last_sequence = 0;
+			uint64_t accepted = 0;
+			uint64_t dropped = 0;
+			uint64_t malformed = 0;
+			uint64_t last_seen = 0;
+		};
+
+		// What an update sets.
+		struct UpdateKey {
+			DeviceType device;
+			DWORD page;
+			UdpKind kind;
+			uint8_t index;
+
+			auto operator<=>(const UpdateKey& other) const = default;
+		};
+
+		struct Update {
+			std::wstring content;
+			DWORD value = 0;
+		};
+
+		void Receive();
+
+		// Applies the pending updates until stopped.
+		void ApplyLoop();
+
+		void HandleDatagram(const std::string& source, const uint8_t* data, size_t size);
+
+		// Returns the stats of the source, making room for it if needed.
+		SourceStats& GetSourceStats(const std::string& source);
+
+		UdpIngressHandlers handlers_;
+
+		asio::io_context io_context_;
+		asio::ip::udp::socket socket_{ io_context_ };
+		asio::ip::udp::endpoint sender_;
+		std::array<uint8_t, kMaxDatagramSize> buffer_ = {};
+		std::thread thread_;
+
+		std::mutex pending_mutex_;
+		std::condition_variable pending_cv_;
+		// The latest update of each line and LED which is not applied yet.
+		std::map<UpdateKey, Update> pending_;
+		uint64_t coalesced_ = 0;
+		bool stopping_ = false;
+		std::thread applier_;
+
+		std::mutex stats_mutex_;
+		std::map<std::string, SourceStats> sources_;
+		uint64_t datagrams_ = 0;
+	};
+}
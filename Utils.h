@@ -5,6 +5,7 @@
 #include "DirectOutput.h"
 #include "types.h"
 #include <optional>
+#include <string_view>
 
 #define RETURN_IF_ERROR(result) \
   { \
@@ -22,22 +23,29 @@ namespace direct_output_proxy {
 	std::wostream& DebugW();
 	std::ostream& Debug();
 
-	constexpr DWORD kButtons[] = {
-		SoftButton_Select,
-		SoftButton_Up,
-		SoftButton_Down,
-	};
-
 	void ReportError(const std::string& message);
 	void ReportError(const std::wstring& message);
+	// Shows a message which is not an error, e.g. a summary.
+	void ReportInfo(const std::string& message);
 
 	DeviceType DeviceTypeGuidToDeviceType(const GUID& device_type);
 	std::wstring DevTypeToString(const DeviceType dev_type);
-	std::wstring ButtonToString(const DWORD button);
+	// Short ASCII name of the device type, used in the API.
+	std::string DevTypeToId(const DeviceType dev_type);
+	std::optional<DeviceType> DevTypeFromId(const std::string& id);
+	// Button names come from the DeviceTraits of the device type.
+	std::wstring ButtonToString(const DeviceType type, const DWORD button);
+	// Finds the button by name among the buttons of the device type.
+	std::optional<DWORD> StringToButton(DeviceType type, const std::string& name);
+	std::optional<ResidencyPolicy> ResidencyPolicyFromString(const std::string& name);
+	std::optional<WriteLane> WriteLaneFromString(const std::string& name);
 
 	std::optional<std::string> WstrToStr(const std::wstring& wstr);
 	std::string WstrToStrOrDie(const std::wstring& wstr);
 
+	// Appends `value` as a JSON string, quoted and escaped.
+	void AppendJsonString(std::string& out, std::string_view value);
+
 	std::string ResultToString(const HRESULT result);
 	int ConvertHresultToHttpCode(const HRESULT result);
 }
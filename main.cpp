@@ -2,19 +2,35 @@
 #include <crow/http_request.h>
 #include <crow/http_response.h>
 
+#include <chrono>
+#include <format>
 #include <string>
 #include <optional>
-#include <set>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <vector>
 
 #include <Windows.h>
 #include <shellapi.h>
+#include "AdmissionControl.h"
 #include "DirectOutputProxy.h"
 #include "DirectOutputDevice.h"
+#include "EventSubscriptions.h"
+#include "ImageLibrary.h"
+#include "ProxyApp.h"
+#include "SharedMemoryChannel.h"
+#include "Tracer.h"
+#include "TrafficLog.h"
+#include "TrafficReplay.h"
+#include "UdpIngress.h"
 #include "types.h"
 #include "utils.h"
 
 namespace {
-	using EventCallback = std::function<void(const std::string&, bool, DWORD)>;
+	using EventCallback = std::function<void(const direct_output_proxy::ButtonEvent&)>;
+
+	constexpr const char* kEventFilterParams[] = { "device", "pages", "buttons", "kinds", "encoding" };
 
 	std::optional<std::wstring> GetParam(const crow::request& req, const std::string& name) {
 		const char* content_param = req.url_params.get(name);
@@ -22,90 +38,438 @@ namespace {
 		std::string content(content_param);
 		return std::wstring(content.begin(), content.end());
 	}
+
+	// Reads an integer param into `value`, leaving it as it is if the param is missing.
+	// Returns false if the param is malformed.
+	bool GetIntParam(const crow::request& req, const std::string& name, int* value) {
+		const char* param = req.url_params.get(name);
+		if (param == nullptr) return true;
+		try {
+			size_t end = 0;
+			*value = std::stoi(param, &end);
+			return param[end] == '\0';
+		} catch (const std::exception&) {
+			return false;
+		}
+	}
+
+	// Reads the expected page version from the If-Match header, or the if_match param.
+	// Returns false if the version is malformed.
+	bool GetIfMatch(const crow::request& req, std::optional<direct_output_proxy::PageVersion>* if_match) {
+		std::string value = req.get_header_value("If-Match");
+		if (value.empty()) {
+			const char* param = req.url_params.get("if_match");
+			if (param == nullptr) return true;
+			value = param;
+		}
+		if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+			value = value.substr(1, value.size() - 2);
+		}
+
+		try {
+			size_t end = 0;
+			*if_match = std::stoull(value, &end);
+			return end == value.size();
+		} catch (const std::exception&) {
+			return false;
+		}
+	}
+
+	// Reads the device a request is for from the device param, e.g. device=fip. Returns `default_type` if
+	// the param is missing, and nullopt if it's invalid.
+	std::optional<direct_output_proxy::DeviceType> GetDeviceParam(const crow::request& req,
+		const direct_output_proxy::DeviceType default_type) {
+		const char* param = req.url_params.get("device");
+		if (param == nullptr) return default_type;
+		return direct_output_proxy::DevTypeFromId(param);
+	}
+
+	// The ID a client names itself with: the X-Client-Id header or the client param, so clients sharing an address
+	// can be told apart. Empty if there's neither.
+	std::string GetClientId(const crow::request& req) {
+		std::string id = req.get_header_value("X-Client-Id");
+		if (id.empty() && req.url_params.get("client") != nullptr) id = req.url_params.get("client");
+		return id;
+	}
+
+	// The client a request comes from: its address and ID, or the address alone.
+	std::string GetClientKey(const crow::request& req) {
+		std::string id = GetClientId(req);
+		if (id.empty()) return req.remote_ip_address;
+		return req.remote_ip_address + "/" + id;
+	}
+
+	// Admits a write request to `device`, or to no device if it's null, or returns the 429 response which tells the
+	// client when to retry.
+	std::optional<crow::response> CheckAdmission(direct_output_proxy::AdmissionControl& admission, const crow::request& req,
+		const direct_output_proxy::DeviceRef* device, direct_output_proxy::AdmissionTicket* ticket) {
+		std::optional<direct_output_proxy::DeviceHandle> handle;
+		size_t queued = 0;
+		if (device != nullptr) {
+			handle = device->handle();
+			queued = (*device)->GetQueueDepth(direct_output_proxy::WriteLaneScope::Current());
+		}
+		std::chrono::seconds retry_after(0);
+		const HRESULT result = admission.Admit(req.remote_ip_address, GetClientId(req), handle, queued, ticket, &retry_after);
+		if (SUCCEEDED(result)) return std::nullopt;
+		crow::response resp(direct_output_proxy::ConvertHresultToHttpCode(result),
+			"error: " + direct_output_proxy::ResultToString(result));
+		resp.set_header("Retry-After", std::to_string(retry_after.count()));
+		return resp;
+	}
+
+	// Reports the page version to the client as an ETag.
+	crow::response WithVersion(crow::response resp, const direct_output_proxy::PageVersion version) {
+		resp.set_header("ETag", "\"" + std::to_string(version) + "\"");
+		return resp;
+	}
+
+	// Collects the event filter params present in the query string.
+	std::map<std::string, std::string> GetEventFilterParams(const crow::request& req) {
+		std::map<std::string, std::string> params;
+		for (const char* name : kEventFilterParams) {
+			const char* value = req.url_params.get(name);
+			if (value != nullptr) params[name] = value;
+		}
+		return params;
+	}
 }
 
 namespace direct_output_proxy {
 	bool InitProxy(DirectOutputProxy& proxy, EventCallback callback) {
 		proxy.RegisterNewDeviceCallback([callback](DirectOutputDevice& device) {
 			if (device.GetType() != DeviceType::kX52Pro) return;
-			device.AddPage(0, { .name = L"info", .top = L"info", }, true);
-			device.AddPage(1, { .name = L"debug", .top = L"debug", }, false);
+			device.AddPage(0, { .name = L"info", .top = L"info", .residency = ResidencyPolicy::kPinned, }, true);
+			device.AddPage(1, { .name = L"debug", .top = L"debug", .residency = ResidencyPolicy::kPinned, }, false);
 			device.RegisterButtonCallback([&device, callback](const DWORD button, const bool down, const DWORD page) {
-				callback(WstrToStrOrDie(ButtonToString(button)), down, page);
+				callback({ .device = device.GetType(), .button = button, .down = down, .page = page });
 				if (!down) return;
-				device.SetLine(1, kMiddleLine, L"Button: " + ButtonToString(button));
+				device.SetLine(1, kMiddleLine, L"Button: " + ButtonToString(device.GetType(), button));
 			});
 		});
 		return proxy.Init();
 	}
 
-	void SetupApp(crow::SimpleApp& app, DirectOutputProxy& proxy, std::set<crow::websocket::connection*>& event_conns, std::mutex& event_conns_mutex) {
-		CROW_ROUTE(app, "/addpage/<int>/<int>")([&proxy](const crow::request& req, const int page, const int activate) {
-			DirectOutputDevice* device = proxy.GetDeviceByType(DeviceType::kX52Pro);
-			if (device == nullptr) return crow::response(404, "no device");
+	// Applies what local clients publish through shared memory to the X52 Pro. These are frame rate updates, so
+	// they use the bulk lane. Every write is recorded if `recorder` is set.
+	SharedMemoryHandlers GetSharedMemoryHandlers(DirectOutputProxy& proxy, TrafficRecorder* recorder) {
+		// Fails what's worth retrying: writes which didn't reach a device, not writes the device rejected.
+		auto with_device = [&proxy, recorder](const IngressCommand& command,
+			const std::function<HRESULT(DirectOutputDevice&)>& fn) -> HRESULT {
+			if (recorder != nullptr) recorder->RecordIngress(command);
+			WriteLaneScope lane(WriteLane::kBulk);
+			DeviceRef device = proxy.GetDeviceByType(DeviceType::kX52Pro);
+			if (!device) return -ERROR_DEVICE_NOT_CONNECTED;
+			const HRESULT result = fn(*device);
+			return DeviceExecutor::IsDeviceFailure(result) || result == -ERROR_SERVICE_NOT_ACTIVE ? result : S_OK;
+		};
+		return {
+			.add_page = [with_device](const uint32_t page, const bool activate) {
+				return with_device({ .op = IngressOp::kAddPage, .device = DeviceType::kX52Pro, .page = page, .value = activate },
+					[&](DirectOutputDevice& device) { return device.AddPage(page, {}, activate); });
+			},
+			.remove_page = [with_device](const uint32_t page) {
+				return with_device({ .op = IngressOp::kRemovePage, .device = DeviceType::kX52Pro, .page = page },
+					[&](DirectOutputDevice& device) { return device.RemovePage(page); });
+			},
+			.set_line = [with_device](const uint32_t page, const uint32_t line, const std::wstring& content) {
+				if (line > kBottomLine) return S_OK;
+				return with_device({ .op = IngressOp::kSetLine, .device = DeviceType::kX52Pro, .page = page, .index = line, .content = content },
+					[&](DirectOutputDevice& device) { return device.SetLine(page, (LineIndex)line, content); });
+			},
+			.set_led = [with_device](const uint32_t page, const uint32_t index, const uint32_t value) {
+				return with_device({ .op = IngressOp::kSetLed, .device = DeviceType::kX52Pro, .page = page, .index = index, .value = value },
+					[&](DirectOutputDevice& device) { return device.SetLed(page, index, value); });
+			},
+		};
+	}
+
+	// Applies updates from the UDP listener to the devices, in the bulk lane. Every update applied is recorded if
+	// `recorder` is set.
+	UdpIngressHandlers GetUdpIngressHandlers(DirectOutputProxy& proxy, TrafficRecorder* recorder) {
+		return {
+			.set_line = [&proxy, recorder](const DeviceType type, const DWORD page, const LineIndex line, const std::wstring& content) {
+				if (recorder != nullptr) {
+					recorder->RecordIngress({ .channel = IngressChannel::kUdp, .op = IngressOp::kSetLine, .device = type, .page = page,
+						.index = line, .content = content });
+				}
+				WriteLaneScope lane(WriteLane::kBulk);
+				DeviceRef device = proxy.GetDeviceByType(type);
+				if (device) device->SetLine(page, line, content);
+			},
+			.set_led = [&proxy, recorder](const DeviceType type, const DWORD page, const DWORD index, const DWORD value) {
+				if (recorder != nullptr) {
+					recorder->RecordIngress({ .channel = IngressChannel::kUdp, .op = IngressOp::kSetLed, .device = type, .page = page,
+						.index = index, .value = value });
+				}
+				WriteLaneScope lane(WriteLane::kBulk);
+				DeviceRef device = proxy.GetDeviceByType(type);
+				if (device) device->SetLed(page, index, value);
+			},
+		};
+	}
+
+	// The pages of the device as JSON, for /state.
+	std::string EncodeDeviceState(DirectOutputDevice& device) {
+		std::optional<DWORD> active = device.GetActivePage();
+		std::string json = std::format(R"({{"device":"{}","id":{},"active":{},"pages":[)", DevTypeToId(device.GetType()),
+			device.GetId(), active.has_value() ? std::to_string(active.value()) : "null");
+		bool first = true;
+		device.ForEachPage([&](const DWORD page, const PageData& data, const PageVersion version) {
+			if (!first) json += ',';
+			first = false;
+			json += std::format(R"({{"page":{},"version":{},"name":)", page, version);
+			AppendJsonString(json, WstrToStr(data.name).value_or(""));
+			json += R"(,"lines":[)";
+			const std::wstring* lines[] = { &data.top, &data.middle, &data.bottom };
+			for (DWORD line = 0; line < device.GetCaps().lines; ++line) {
+				if (line > 0) json += ',';
+				AppendJsonString(json, WstrToStr(*lines[line]).value_or(""));
+			}
+			json += "]}";
+		});
+		json += "]}";
+		return json;
+	}
+
+	// Identifies a websocket connection in the traffic log.
+	uint64_t GetConnectionId(crow::websocket::connection& conn) {
+		return reinterpret_cast<uintptr_t>(&conn);
+	}
+
+	void SetupApp(ProxyApp& app, DirectOutputProxy& proxy, EventSubscriptions& subscriptions, ImageLibrary& images,
+		AdmissionControl& admission, UdpIngress* udp, TrafficRecorder* recorder) {
+		CROW_ROUTE(app, "/addpage/<int>/<int>")([&proxy, &admission](const crow::request& req, const int page, const int activate) {
+			TraceSpan span("route /addpage");
+			std::optional<DeviceType> type = GetDeviceParam(req, DeviceType::kX52Pro);
+			if (!type.has_value()) return crow::response(400, "invalid param: device");
+			DeviceRef device = proxy.GetDeviceByType(type.value());
+			if (!device) return crow::response(404, "no device");
+			AdmissionTicket ticket;
+			std::optional<crow::response> rejected = CheckAdmission(admission, req, &device, &ticket);
+			if (rejected.has_value()) return std::move(rejected.value());
 
 			PageData data;
 
 			std::optional<std::wstring> name = GetParam(req, "name");
 			if (name.has_value()) data.name = name.value();
-			std::optional<std::wstring> top = GetParam(req, "top");
-			if (top.has_value()) data.top = top.value();
-			std::optional<std::wstring> middle = GetParam(req, "middle");
-			if (middle.has_value()) data.middle = middle.value();
-			std::optional<std::wstring> bottom = GetParam(req, "bottom");
-			if (bottom.has_value()) data.bottom = bottom.value();
-
-			HRESULT result = device->AddPage(page, data, activate != 0);
+			const char* line_params[] = { "top", "middle", "bottom" };
+			std::wstring* lines[] = { &data.top, &data.middle, &data.bottom };
+			for (DWORD line = 0; line < std::size(lines); ++line) {
+				std::optional<std::wstring> content = GetParam(req, line_params[line]);
+				if (!content.has_value()) continue;
+				if (line >= device->GetCaps().lines) return crow::response(400, std::string("invalid param: ") + line_params[line]);
+				*lines[line] = content.value();
+			}
+
+			const char* policy = req.url_params.get("policy");
+			if (policy != nullptr) {
+				std::optional<ResidencyPolicy> residency = ResidencyPolicyFromString(policy);
+				if (!residency.has_value()) return crow::response(400, "invalid param: policy");
+				data.residency = residency.value();
+			}
+			if (!GetIntParam(req, "priority", &data.priority)) return crow::response(400, "invalid param: priority");
+
+			std::optional<PageVersion> if_match;
+			if (!GetIfMatch(req, &if_match)) return crow::response(400, "invalid param: if_match");
+
+			PageVersion version = 0;
+			HRESULT result = device->AddPage(page, data, activate != 0, if_match, &version);
 			if (FAILED(result)) {
-				return crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result));
+				return WithVersion(crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result)),
+					device->GetPageVersion(page));
 			}
-			return crow::response(200, "ok");
+			return WithVersion(crow::response(200, "ok"), version);
 		});
 
-		CROW_ROUTE(app, "/delpage/<int>")([&proxy](const int page) {
-			DirectOutputDevice* device = proxy.GetDeviceByType(DeviceType::kX52Pro);
-			if (device == nullptr) return crow::response(404, "no device");
+		CROW_ROUTE(app, "/delpage/<int>")([&proxy, &admission](const crow::request& req, const int page) {
+			TraceSpan span("route /delpage");
+			std::optional<DeviceType> type = GetDeviceParam(req, DeviceType::kX52Pro);
+			if (!type.has_value()) return crow::response(400, "invalid param: device");
+			DeviceRef device = proxy.GetDeviceByType(type.value());
+			if (!device) return crow::response(404, "no device");
+			AdmissionTicket ticket;
+			std::optional<crow::response> rejected = CheckAdmission(admission, req, &device, &ticket);
+			if (rejected.has_value()) return std::move(rejected.value());
 
-			HRESULT result = device->RemovePage(page);
+			std::optional<PageVersion> if_match;
+			if (!GetIfMatch(req, &if_match)) return crow::response(400, "invalid param: if_match");
+
+			PageVersion version = 0;
+			HRESULT result = device->RemovePage(page, if_match, &version);
 			if (FAILED(result)) {
-				return crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result));
+				return WithVersion(crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result)),
+					device->GetPageVersion(page));
 			}
-			return crow::response(200, "ok");
+			return WithVersion(crow::response(200, "ok"), version);
 		});
 
-		CROW_ROUTE(app, "/setline/<int>/<int>")([&proxy](const crow::request& req, const int page, const int line) {
-			DirectOutputDevice* device = proxy.GetDeviceByType(DeviceType::kX52Pro);
-			if (device == nullptr) return crow::response(404, "no device");
+		CROW_ROUTE(app, "/setline/<int>/<int>")([&proxy, &admission](const crow::request& req, const int page, const int line) {
+			TraceSpan span("route /setline");
+			std::optional<DeviceType> type = GetDeviceParam(req, DeviceType::kX52Pro);
+			if (!type.has_value()) return crow::response(400, "invalid param: device");
+			DeviceRef device = proxy.GetDeviceByType(type.value());
+			if (!device) return crow::response(404, "no device");
+			AdmissionTicket ticket;
+			std::optional<crow::response> rejected = CheckAdmission(admission, req, &device, &ticket);
+			if (rejected.has_value()) return std::move(rejected.value());
 
-			if (line < 0 || line > 2) {
+			if (line < 0 || line >= static_cast<int>(device->GetCaps().lines)) {
 				return crow::response(416, "invalid argument: line");
 			}
 
 			std::optional<std::wstring> content = GetParam(req, "content");
 			if (!content.has_value()) return crow::response(400, "missing param: content");
 
-			HRESULT result = device->SetLine(page, (LineIndex)line, content.value());
+			std::optional<PageVersion> if_match;
+			if (!GetIfMatch(req, &if_match)) return crow::response(400, "invalid param: if_match");
+
+			PageVersion version = 0;
+			HRESULT result = device->SetLine(page, (LineIndex)line, content.value(), if_match, &version);
 			if (FAILED(result)) {
-				return crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result));
+				return WithVersion(crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result)),
+					device->GetPageVersion(page));
+			}
+			return WithVersion(crow::response(200, "ok"), version);
+		});
+
+		CROW_ROUTE(app, "/setregion/<int>/<string>")([&proxy, &admission](const crow::request& req, const int page, const std::string& id) {
+			TraceSpan span("route /setregion");
+			std::optional<DeviceType> type = GetDeviceParam(req, DeviceType::kX52Pro);
+			if (!type.has_value()) return crow::response(400, "invalid param: device");
+			DeviceRef device = proxy.GetDeviceByType(type.value());
+			if (!device) return crow::response(404, "no device");
+			AdmissionTicket ticket;
+			std::optional<crow::response> rejected = CheckAdmission(admission, req, &device, &ticket);
+			if (rejected.has_value()) return std::move(rejected.value());
+
+			int line = 0, column = 0, width = 0, priority = 0, ttl = static_cast<int>(kDefaultRegionTtl.count());
+			if (!GetIntParam(req, "line", &line) || line < 0) return crow::response(400, "invalid param: line");
+			if (!GetIntParam(req, "column", &column) || column < 0) return crow::response(400, "invalid param: column");
+			if (!GetIntParam(req, "width", &width) || width < 0) return crow::response(400, "invalid param: width");
+			if (!GetIntParam(req, "priority", &priority)) return crow::response(400, "invalid param: priority");
+			if (!GetIntParam(req, "ttl", &ttl) || ttl <= 0 || ttl > kMaxRegionTtl.count()) {
+				return crow::response(400, "invalid param: ttl");
 			}
+
+			Region region = { .line = static_cast<LineIndex>(line), .column = static_cast<DWORD>(column),
+				.width = static_cast<DWORD>(width), .priority = priority, .content = GetParam(req, "content").value_or(L""),
+				.expires = std::chrono::steady_clock::now() + std::chrono::seconds(ttl) };
+
+			HRESULT result = device->SetRegion(page, { GetClientKey(req), id }, region);
+			if (FAILED(result)) return crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result));
+			return crow::response(200, "ok");
+		});
+
+		CROW_ROUTE(app, "/delregion/<int>/<string>")([&proxy, &admission](const crow::request& req, const int page, const std::string& id) {
+			TraceSpan span("route /delregion");
+			std::optional<DeviceType> type = GetDeviceParam(req, DeviceType::kX52Pro);
+			if (!type.has_value()) return crow::response(400, "invalid param: device");
+			DeviceRef device = proxy.GetDeviceByType(type.value());
+			if (!device) return crow::response(404, "no device");
+			AdmissionTicket ticket;
+			std::optional<crow::response> rejected = CheckAdmission(admission, req, &device, &ticket);
+			if (rejected.has_value()) return std::move(rejected.value());
+
+			HRESULT result = device->RemoveRegion(page, { GetClientKey(req), id });
+			if (FAILED(result)) return crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result));
+			return crow::response(200, "ok");
+		});
+
+		CROW_ROUTE(app, "/images/<string>").methods(crow::HTTPMethod::Post)([&images, &admission](const crow::request& req, const std::string& id) {
+			AdmissionTicket ticket;
+			std::optional<crow::response> rejected = CheckAdmission(admission, req, nullptr, &ticket);
+			if (rejected.has_value()) return std::move(rejected.value());
+			HRESULT result = images.Store(id, req.body);
+			if (FAILED(result)) return crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result));
 			return crow::response(200, "ok");
 		});
 
+		CROW_ROUTE(app, "/setimage/<int>/<string>")([&proxy, &images, &admission](const crow::request& req, const int page, const std::string& image) {
+			TraceSpan span("route /setimage");
+			std::optional<DeviceType> type = GetDeviceParam(req, DeviceType::kFip);
+			if (!type.has_value()) return crow::response(400, "invalid param: device");
+			DeviceRef device = proxy.GetDeviceByType(type.value());
+			if (!device) return crow::response(404, "no device");
+			AdmissionTicket ticket;
+			std::optional<crow::response> rejected = CheckAdmission(admission, req, &device, &ticket);
+			if (rejected.has_value()) return std::move(rejected.value());
+
+			const DeviceCaps& caps = device->GetCaps();
+			if (!caps.image) return crow::response(400, "device can't show images");
+			std::optional<LibraryImage> library_image = images.Get(image);
+			if (!library_image.has_value()) return crow::response(404, "no image");
+			if (library_image->width != caps.image_width || library_image->height != caps.image_height) {
+				return crow::response(400, "image must be " + std::to_string(caps.image_width) + "x" + std::to_string(caps.image_height));
+			}
+
+			std::optional<PageVersion> if_match;
+			if (!GetIfMatch(req, &if_match)) return crow::response(400, "invalid param: if_match");
+
+			PageVersion version = 0;
+			HRESULT result = device->SetImage(page, image, if_match, &version);
+			if (FAILED(result)) {
+				return WithVersion(crow::response(ConvertHresultToHttpCode(result), "error: " + ResultToString(result)),
+					device->GetPageVersion(page));
+			}
+			return WithVersion(crow::response(200, "ok"), version);
+		});
+
+		// The filter parsed when accepting a connection is kept in its userdata until the connection ends, as
+		// a connection may close before it opens.
+		auto release_connection = [&subscriptions](crow::websocket::connection& conn) {
+			subscriptions.Remove(&conn);
+			delete static_cast<EventFilter*>(conn.userdata());
+			conn.userdata(nullptr);
+		};
+
 		CROW_WEBSOCKET_ROUTE(app, "/events")
-			.onopen([&event_conns, &event_conns_mutex](crow::websocket::connection& conn) {
+			.onaccept([](const crow::request& req, void** userdata) {
+			auto filter = std::make_unique<EventFilter>();
+			std::optional<std::string> error = ParseEventFilter(GetEventFilterParams(req), filter.get());
+			if (error.has_value()) {
+				Debug() << "ws rejected: " << error.value() << std::endl;
+				return false;
+			}
+			*userdata = filter.release();
+			return true;
+		})
+			.onopen([&subscriptions, recorder](crow::websocket::connection& conn) {
 			Debug() << "ws open from " << conn.get_remote_ip() << std::endl;
 
-			std::lock_guard lock(event_conns_mutex);
-			event_conns.insert(&conn);
+			const EventFilter* filter = static_cast<EventFilter*>(conn.userdata());
+			if (recorder != nullptr) recorder->RecordWebSocketOpen(GetConnectionId(conn), filter ? *filter : EventFilter());
+			subscriptions.Add(&conn, filter ? *filter : EventFilter());
+		})
+			.onmessage([&subscriptions, recorder](crow::websocket::connection& conn, const std::string& data, bool is_binary) {
+			if (is_binary) {
+				conn.send_text("error: unknown command");
+				return;
+			}
+			if (recorder != nullptr) recorder->RecordWebSocketMessage(GetConnectionId(conn), data);
+
+			EventFilter filter;
+			std::optional<std::string> error = ParseFilterMessage(data, &filter);
+			if (error.has_value()) {
+				conn.send_text("error: " + error.value());
+				return;
+			}
+			subscriptions.Update(&conn, filter);
+			conn.send_text("ok");
 		})
-			.onclose([&event_conns, &event_conns_mutex](crow::websocket::connection& conn, const std::string& reason, uint16_t status_code) {
+			.onclose([release_connection, recorder](crow::websocket::connection& conn, const std::string& reason, uint16_t status_code) {
 			Debug() << "ws close: " << reason << std::endl;
 
-			std::lock_guard lock(event_conns_mutex);
-			event_conns.erase(&conn);
+			if (recorder != nullptr) recorder->RecordWebSocketClose(GetConnectionId(conn));
+			release_connection(conn);
+		})
+			.onerror([release_connection](crow::websocket::connection& conn, const std::string& error) {
+			Debug() << "ws error: " << error << std::endl;
+
+			release_connection(conn);
 		});
 
-		CROW_ROUTE(app, "/")([&proxy]() {
+		CROW_ROUTE(app, "/")([&proxy, &images, &admission, udp]() {
 			std::string resp = "DirectOutputProxy running\n";
 			proxy.ApplyToDevices([&resp](DirectOutputDevice& device) {
 				std::optional<std::string> info = WstrToStr(device.GetInfo());
@@ -113,43 +477,194 @@ namespace direct_output_proxy {
 					resp += info.value();
 				}
 			});
+			resp += "\n" + proxy.GetEventInfo();
+			resp += "\nimages: " + std::to_string(images.GetSize());
+			resp += "\n" + admission.GetInfo();
+			if (udp != nullptr) {
+				resp += "\n" + udp->GetInfo();
+			}
 
 			return crow::response(200, resp);
 		});
 
+		CROW_ROUTE(app, "/state")([&proxy, &subscriptions]() {
+			// Read before the state: changes made meanwhile are in the snapshot and also sent as state events,
+			// which is harmless as they carry new values.
+			const uint64_t sequence = subscriptions.GetStateSequence();
+			std::string json = std::format(R"({{"seq":{},"devices":[)", sequence);
+			bool first = true;
+			proxy.ApplyToDevices([&](DirectOutputDevice& device) {
+				if (!first) json += ',';
+				first = false;
+				json += EncodeDeviceState(device);
+			});
+			json += "]}";
+
+			crow::response resp(200, json);
+			resp.set_header("Content-Type", "application/json");
+			return resp;
+		});
+
+		CROW_ROUTE(app, "/trace")([](const crow::request& req) {
+			int seconds = 10;
+			const char* seconds_param = req.url_params.get("seconds");
+			if (seconds_param != nullptr) {
+				try {
+					seconds = std::stoi(seconds_param);
+				} catch (const std::exception&) {
+					return crow::response(400, "invalid param: seconds");
+				}
+				if (seconds <= 0) return crow::response(400, "invalid param: seconds");
+			}
+
+			crow::response resp(200, ExportTrace(seconds));
+			resp.set_header("Content-Type", "application/json");
+			return resp;
+		});
+
 		CROW_ROUTE(app, "/exit")([&app]() {
 			app.stop();
 			return "ok";
 		});
 	}
+
+	std::filesystem::path GetImageDirectory() {
+		return std::filesystem::temp_directory_path() / "DirectOutputProxy" / "images";
+	}
+
+	// Replays a traffic log against a proxy using FakeDirectOutput, instead of serving clients.
+	int RunReplay(const std::wstring& path, const double speed, const AdmissionLimits& limits) {
+		TrafficLogReader reader;
+		if (!reader.Open(path)) {
+			ReportError(L"Failed to open traffic log " + path);
+			return 1;
+		}
+
+		EventSubscriptions subscriptions;
+		ProxyApp app;
+		ImageLibrary images(GetImageDirectory());
+		AdmissionControl admission(limits);
+		DirectOutputProxy proxy(/*fake_sdk=*/true);
+		proxy.SetImageLibrary(&images);
+		proxy.RegisterStateCallback([&subscriptions](const StateEvent& event) { subscriptions.PublishState(event); });
+		if (!InitProxy(proxy, [&subscriptions](const ButtonEvent& event) { subscriptions.Publish(event); })) return 1;
+		SetupApp(app, proxy, subscriptions, images, admission, nullptr, nullptr);
+		app.validate();
+
+		{
+			TrafficReplay replay(app, subscriptions, GetSharedMemoryHandlers(proxy, nullptr), GetUdpIngressHandlers(proxy, nullptr));
+			ReportInfo(replay.Run(reader, speed));
+		}
+
+		if (!proxy.Shutdown()) return 1;
+		return 0;
+	}
 }
 
 int main() {
 	int argc;
 	LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
 
-	std::set<crow::websocket::connection*> event_conns;
-	std::mutex event_conns_mutex;
-	EventCallback event_cb = [&event_conns, &event_conns_mutex](const std::string& button, const bool down, const DWORD page) {
-		std::string msg = std::format("{} {} {}", button, down, page);
-
-		std::lock_guard lock(event_conns_mutex);
-		for (const auto& conn : event_conns) {
-			conn->send_text(msg);
+	// Options may come anywhere, the rest are the HTTP port and the UDP port.
+	std::optional<std::wstring> record_path, replay_path;
+	double replay_speed = 1;
+	direct_output_proxy::AdmissionLimits limits;
+	std::optional<double> client_rate, address_rate;
+	std::vector<std::wstring> args;
+	for (int i = 1; i < argc; ++i) {
+		std::wstring arg = argv[i];
+		if (arg == L"--record" && i + 1 < argc) {
+			record_path = argv[++i];
+		} else if (arg == L"--replay" && i + 1 < argc) {
+			replay_path = argv[++i];
+		} else if (arg == L"--trace" && i + 1 < argc) {
+			direct_output_proxy::SetTraceSampling(static_cast<uint32_t>(std::stoul(argv[++i])));
+		} else if (arg == L"--rate" && i + 1 < argc) {
+			client_rate = std::stod(argv[++i]);
+		} else if (arg == L"--burst" && i + 1 < argc) {
+			limits.client_burst = std::stod(argv[++i]);
+		} else if (arg == L"--address-rate" && i + 1 < argc) {
+			address_rate = std::stod(argv[++i]);
+		} else if (arg == L"--address-burst" && i + 1 < argc) {
+			limits.address_burst = std::stod(argv[++i]);
+		} else if (arg == L"--inflight" && i + 1 < argc) {
+			limits.device_in_flight = static_cast<uint32_t>(std::stoul(argv[++i]));
+		} else if (arg == L"--speed" && i + 1 < argc) {
+			std::wstring speed = argv[++i];
+			replay_speed = speed == L"max" ? 0 : std::stod(speed);
+		} else {
+			args.push_back(arg);
 		}
+	}
+
+	// Replays run as fast as recorded, so they're not rate limited unless asked to.
+	limits.client_rate = client_rate.value_or(replay_path.has_value() ? 0 : limits.client_rate);
+	limits.address_rate = address_rate.value_or(replay_path.has_value() ? 0 : limits.address_rate);
+	// A bucket which can't hold a whole token would reject every request.
+	if (limits.client_rate > 0 && limits.client_burst < 1) {
+		direct_output_proxy::ReportError(L"--burst must be at least 1 when clients are rate limited");
+		return 1;
+	}
+	if (limits.address_rate > 0 && limits.address_burst < 1) {
+		direct_output_proxy::ReportError(L"--address-burst must be at least 1 when addresses are rate limited");
+		return 1;
+	}
+
+	if (replay_path.has_value()) return direct_output_proxy::RunReplay(replay_path.value(), replay_speed, limits);
+
+	direct_output_proxy::EventSubscriptions subscriptions;
+	EventCallback event_cb = [&subscriptions](const direct_output_proxy::ButtonEvent& event) {
+		subscriptions.Publish(event);
 	};
 
-	crow::SimpleApp app;
+	direct_output_proxy::ProxyApp app;
+	direct_output_proxy::ImageLibrary images(direct_output_proxy::GetImageDirectory());
+	direct_output_proxy::AdmissionControl admission(limits);
 	direct_output_proxy::DirectOutputProxy proxy;
+	proxy.SetImageLibrary(&images);
+
+	direct_output_proxy::TrafficRecorder recorder;
+	if (record_path.has_value()) {
+		if (!recorder.Open(record_path.value())) {
+			direct_output_proxy::ReportError(L"Failed to open " + record_path.value());
+			return 1;
+		}
+		proxy.SetRecorder(&recorder);
+		app.get_middleware<direct_output_proxy::RecordingMiddleware>().recorder = &recorder;
+	}
+
+	proxy.RegisterStateCallback([&subscriptions](const direct_output_proxy::StateEvent& event) {
+		subscriptions.PublishState(event);
+	});
 	if (!direct_output_proxy::InitProxy(proxy, event_cb)) return 1;
-	direct_output_proxy::SetupApp(app, proxy, event_conns, event_conns_mutex);
 
 	int port = 8080;
-	if (argc > 1) {
-		port = std::stoi(argv[1]);
+	if (args.size() > 0) {
+		port = std::stoi(args[0]);
 	}
+
+	// The UDP listener is only started if a port is given.
+	std::unique_ptr<direct_output_proxy::UdpIngress> udp;
+	if (args.size() > 1) {
+		udp = std::make_unique<direct_output_proxy::UdpIngress>(direct_output_proxy::GetUdpIngressHandlers(proxy,
+			record_path.has_value() ? &recorder : nullptr));
+		if (!udp->Start(static_cast<uint16_t>(std::stoi(args[1])))) udp.reset();
+	}
+
+	direct_output_proxy::SetupApp(app, proxy, subscriptions, images, admission, udp.get(), record_path.has_value() ? &recorder : nullptr);
+
+	direct_output_proxy::SharedMemoryChannel shm_channel(direct_output_proxy::GetSharedMemoryHandlers(proxy,
+		record_path.has_value() ? &recorder : nullptr));
+	if (!shm_channel.Start()) {
+		direct_output_proxy::Debug() << "shared memory interface not available" << std::endl;
+	}
+
 	app.port(port).run();
 
+	shm_channel.Stop();
+	if (udp) udp->Stop();
+	recorder.Close();
+
 	if (!proxy.Shutdown()) return 1;
 	return 0;
 }
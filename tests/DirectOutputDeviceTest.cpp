@@ -0,0 +1,166 @@
+// Checks that conditional writes to a page are atomic: of two writes racing with the same If-Match version,
+// exactly one wins, that only writes which changed the page and reached the device move its version, that
+// readers and device events don't wait for the device, and that an interactive write overtakes queued bulk writes.
+// Runs the device against FakeDirectOutput. Built and run by tests/DirectOutputDeviceTest.vcxproj, from the
+// project's sources other than main.cpp.
+
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DirectOutputDevice.h"
+#include "DirectOutputProxy.h"
+#include "FakeDirectOutput.h"
+#include "types.h"
+
+using namespace direct_output_proxy;
+
+namespace {
+	constexpr int kRounds = 1000;
+	constexpr DWORD kPage = 1;
+
+	int failures = 0;
+	std::atomic<int> line_events = 0;
+
+	void Check(const bool condition, const char* what) {
+		if (condition) return;
+		std::fprintf(stderr, "FAILED: %s\n", what);
+		++failures;
+	}
+
+	void TestConditionalWritesRace(DirectOutputDevice& device) {
+		Check(SUCCEEDED(device.AddPage(kPage, { .name = L"race" }, /*activate=*/true)), "page added");
+
+		std::barrier start(2);
+		for (int round = 0; round < kRounds; ++round) {
+			const PageVersion version = device.GetPageVersion(kPage);
+			HRESULT results[2] = {};
+			PageVersion written[2] = {};
+			auto write = [&](const int writer) {
+				start.arrive_and_wait();
+				results[writer] = device.SetLine(kPage, kTopLine, (writer == 0 ? L"first " : L"second ") + std::to_wstring(round),
+					version, &written[writer]);
+			};
+			std::thread first(write, 0);
+			std::thread second(write, 1);
+			first.join();
+			second.join();
+
+			const int won = (SUCCEEDED(results[0]) ? 1 : 0) + (SUCCEEDED(results[1]) ? 1 : 0);
+			Check(won == 1, "exactly one conditional write wins");
+			Check(results[0] == -ERROR_REVISION_MISMATCH || results[1] == -ERROR_REVISION_MISMATCH, "the other is a mismatch");
+			Check(device.GetPageVersion(kPage) == version + 1, "the version is bumped once");
+			Check(written[SUCCEEDED(results[0]) ? 0 : 1] == version + 1, "the winner gets the new version");
+		}
+	}
+
+	std::wstring GetTopLine(DirectOutputDevice& device, const DWORD page) {
+		std::wstring top;
+		device.ForEachPage([&](const DWORD candidate, const PageData& data, PageVersion) {
+			if (candidate == page) top = data.top;
+		});
+		return top;
+	}
+
+	void TestVersionFollowsDevice(DirectOutputDevice& device) {
+		Check(SUCCEEDED(device.SetLine(kPage, kTopLine, L"kept")), "line written");
+		const PageVersion version = device.GetPageVersion(kPage);
+		const int events = line_events;
+
+		PageVersion written = 0;
+		Check(SUCCEEDED(device.SetLine(kPage, kTopLine, L"kept", std::nullopt, &written)), "unchanged line written");
+		Check(device.GetPageVersion(kPage) == version && written == version, "an unchanged line keeps the version");
+		Check(line_events == events, "an unchanged line isn't published");
+
+		FakeDirectOutput::SetWriteResult(E_INVALIDARG);
+		Check(FAILED(device.SetLine(kPage, kTopLine, L"lost")), "a write the device fails fails");
+		Check(FAILED(device.SetLed(kPage, 0, 1)), "an LED the device fails fails");
+		FakeDirectOutput::SetWriteResult(S_OK);
+		Check(device.GetPageVersion(kPage) == version, "a failed write keeps the version");
+		Check(line_events == events, "a failed write isn't published");
+		Check(GetTopLine(device, kPage) == L"kept", "a failed write leaves the page as it was");
+
+		Check(SUCCEEDED(device.SetLine(kPage, kTopLine, L"changed")), "line changed");
+		Check(device.GetPageVersion(kPage) == version + 1, "a changed line bumps the version");
+		Check(line_events == events + 1, "a changed line is published");
+	}
+
+	void TestReadersDontWaitForDevice(DirectOutputDevice& device) {
+		constexpr auto kLatency = std::chrono::milliseconds(200);
+		FakeDirectOutput::SetCallLatency(kLatency);
+		std::thread writer([&device]() { device.SetLine(kPage, kTopLine, L"slow"); });
+		// Let the write reach the device.
+		std::this_thread::sleep_for(kLatency / 4);
+
+		const auto start = std::chrono::steady_clock::now();
+		device.GetPageVersion(kPage);
+		device.ForEachPage([](DWORD, const PageData&, PageVersion) {});
+		device.HandleEvent({ .type = SdkEventType::kButtons, .device = device.GetHandle(), .value = 0,
+			.time = std::chrono::steady_clock::now() });
+		Check(std::chrono::steady_clock::now() - start < kLatency / 2, "readers and events don't wait for a write");
+
+		writer.join();
+		FakeDirectOutput::SetCallLatency(std::chrono::microseconds(0));
+	}
+
+	void TestInteractiveOvertakesBulk(DirectOutputDevice& device) {
+		constexpr int kBulkWrites = 10;
+		// Well below kLaneAgingLimit for the whole queue, so no bulk write ages past the interactive one.
+		FakeDirectOutput::SetCallLatency(std::chrono::milliseconds(5));
+		std::atomic<int> bulk_done = 0;
+		std::vector<std::thread> bulk;
+		for (int i = 0; i < kBulkWrites; ++i) {
+			bulk.emplace_back([&device, &bulk_done, i]() {
+				WriteLaneScope lane(WriteLane::kBulk);
+				device.SetLine(kPage, kMiddleLine, L"bulk " + std::to_wstring(i));
+				++bulk_done;
+			});
+		}
+		// One bulk write runs, the others wait for it.
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (device.GetQueueDepth(WriteLane::kBulk) < kBulkWrites - 1 && std::chrono::steady_clock::now() < deadline) {
+			std::this_thread::yield();
+		}
+		Check(device.GetQueueDepth(WriteLane::kBulk) == kBulkWrites - 1, "bulk writes are queued");
+
+		{
+			WriteLaneScope lane(WriteLane::kInteractive);
+			Check(SUCCEEDED(device.SetLine(kPage, kTopLine, L"interactive")), "interactive write written");
+		}
+		Check(bulk_done <= 1, "the interactive write only waits for the running bulk write");
+
+		for (std::thread& thread : bulk) thread.join();
+		Check(bulk_done == kBulkWrites, "the bulk writes are written");
+		FakeDirectOutput::SetCallLatency(std::chrono::microseconds(0));
+	}
+}
+
+int main() {
+	DirectOutputProxy proxy(/*fake_sdk=*/true);
+	FakeDirectOutput::SetCallLatency(std::chrono::microseconds(0));
+	proxy.RegisterStateCallback([](const StateEvent& event) {
+		if (event.change == StateChange::kLine && event.page == kPage) ++line_events;
+	});
+	if (!proxy.Init()) {
+		std::fprintf(stderr, "FAILED: fake SDK initializes\n");
+		return 1;
+	}
+	DeviceRef device = proxy.GetDeviceByType(DeviceType::kX52Pro);
+	Check(static_cast<bool>(device), "fake X52 Pro attached");
+	if (device) {
+		TestConditionalWritesRace(*device);
+		TestVersionFollowsDevice(*device);
+		TestReadersDontWaitForDevice(*device);
+		TestInteractiveOvertakesBulk(*device);
+	}
+	device = {};
+
+	proxy.Shutdown();
+	if (failures > 0) return 1;
+	std::printf("OK\n");
+	return 0;
+}
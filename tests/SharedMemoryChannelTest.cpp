@@ -0,0 +1,146 @@
+// Checks that the shared memory channel retries what its handlers fail, in order, and only passes on again
+// what wasn't applied. Built and run by tests/SharedMemoryChannelTest.vcxproj; elsewhere it runs on the POSIX
+// implementation:
+//   g++ -std=c++20 -I. tests/SharedMemoryChannelTest.cpp SharedMemoryChannel.cpp -o shm_channel_test && ./shm_channel_test
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SharedMemoryChannel.h"
+
+using namespace direct_output_proxy;
+
+namespace {
+	constexpr HRESULT kNotConnected = -1167;
+
+	int failures = 0;
+
+	void Check(const bool condition, const char* what) {
+		if (condition) return;
+		std::fprintf(stderr, "FAILED: %s\n", what);
+		++failures;
+	}
+
+	bool WaitFor(const std::function<bool()>& condition) {
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+		while (!condition()) {
+			if (std::chrono::steady_clock::now() > deadline) return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		return true;
+	}
+
+	// Records the calls which succeeded, and fails calls while `attached` is false.
+	struct FakeDevice {
+		std::mutex mutex;
+		bool attached = false;
+		std::vector<std::string> calls;
+		int failed = 0;
+
+		HRESULT Call(const std::string& call) {
+			std::lock_guard lock(mutex);
+			if (!attached) {
+				++failed;
+				return kNotConnected;
+			}
+			calls.push_back(call);
+			return 0;
+		}
+
+		void Attach() {
+			std::lock_guard lock(mutex);
+			attached = true;
+		}
+
+		std::vector<std::string> GetCalls() {
+			std::lock_guard lock(mutex);
+			return calls;
+		}
+
+		int GetFailed() {
+			std::lock_guard lock(mutex);
+			return failed;
+		}
+	};
+
+	SharedMemoryHandlers GetHandlers(FakeDevice& device) {
+		return {
+			.add_page = [&device](const uint32_t page, bool) { return device.Call("add " + std::to_string(page)); },
+			.remove_page = [&device](const uint32_t page) { return device.Call("remove " + std::to_string(page)); },
+			.set_line = [&device](const uint32_t page, const uint32_t line, const std::wstring& content) {
+				return device.Call("line " + std::to_string(page) + " " + std::to_string(line) + " " +
+					std::string(content.begin(), content.end()));
+			},
+			.set_led = [&device](const uint32_t page, const uint32_t index, const uint32_t value) {
+				return device.Call("led " + std::to_string(page) + " " + std::to_string(index) + " " + std::to_string(value));
+			},
+		};
+	}
+
+	void TestRetriesUntilAttached(const std::string& name) {
+		FakeDevice device;
+		SharedMemoryChannel channel(GetHandlers(device));
+		Check(channel.Start(name), "channel starts");
+		SharedMemoryClient client;
+		Check(client.Open(name), "client opens");
+
+		client.AddPage(1, true);
+		client.AddPage(2, false);
+		client.SetLine(1, 0, u"hello");
+		Check(WaitFor([&] { return device.GetFailed() >= 2; }), "add is retried while detached");
+
+		device.Attach();
+		const std::vector<std::string> expected = { "add 1", "add 2", "line 1 0 hello" };
+		Check(WaitFor([&] { return device.GetCalls().size() >= expected.size(); }), "applied once attached");
+		Check(device.GetCalls() == expected, "commands keep their order, state follows them");
+
+		client.SetLed(1, 0, 1);
+		Check(WaitFor([&] { return device.GetCalls().size() >= 4; }), "LED applied");
+		std::this_thread::sleep_for(std::chrono::milliseconds(250));
+		Check(device.GetCalls().size() == 4 && device.GetCalls().back() == "led 1 0 1", "applied lines aren't passed on again");
+
+		client.Close();
+		channel.Stop();
+	}
+
+	void TestRetriesOnlyWhatFailed(const std::string& name) {
+		FakeDevice device;
+		device.Attach();
+		int line_failures = 2;
+		SharedMemoryHandlers handlers = GetHandlers(device);
+		handlers.set_line = [&device, &line_failures](const uint32_t /*page*/, const uint32_t line, const std::wstring& content) {
+			if (line == 1 && line_failures-- > 0) return kNotConnected;
+			return device.Call("line " + std::to_string(line) + " " + std::string(content.begin(), content.end()));
+		};
+		SharedMemoryChannel channel(std::move(handlers));
+		Check(channel.Start(name), "channel starts");
+		SharedMemoryClient client;
+		Check(client.Open(name), "client opens");
+
+		client.AddPage(1, true);
+		client.SetLine(1, 0, u"top");
+		client.SetLine(1, 1, u"middle");
+		Check(WaitFor([&] { return device.GetCalls().size() >= 3; }), "failed line is retried");
+		std::this_thread::sleep_for(std::chrono::milliseconds(250));
+		const std::vector<std::string> expected = { "add 1", "line 0 top", "line 1 middle" };
+		Check(device.GetCalls() == expected, "only the failed line is passed on again");
+
+		client.Close();
+		channel.Stop();
+	}
+}
+
+int main() {
+	// Unique, so a block left by a crashed run isn't reused.
+	const std::string name = "DirectOutputProxyTest" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+	TestRetriesUntilAttached(name);
+	TestRetriesOnlyWhatFailed(name);
+	if (failures > 0) return 1;
+	std::printf("OK\n");
+	return 0;
+}
@@ -2,18 +2,41 @@
 
 #include <string>
 #include <map>
+#include <cstdint>
 #include <Windows.h>
 
 namespace direct_output_proxy {
+	// Decides which pages stay on the device when there are more pages than device slots.
+	enum class ResidencyPolicy {
+		// Evicted when it's the least recently used page.
+		kLru,
+		// Evicted before pages with a higher priority, least recently used first among equal priorities.
+		kPriority,
+		// Never evicted.
+		kPinned,
+	};
+
 	struct PageData {
 		std::wstring name;
 		std::wstring top;
 		std::wstring middle;
 		std::wstring bottom;
+		// LED index -> value. LEDs without a value are left as they are.
+		std::map<DWORD, DWORD> leds;
+		ResidencyPolicy residency = ResidencyPolicy::kLru;
+		// Only used with ResidencyPolicy::kPriority.
+		int priority = 0;
+		// FIP only: ID of the ImageLibrary image shown on the page, empty for none.
+		std::string image;
+
+		bool operator==(const PageData& other) const = default;
 	};
 
 	using PagesData = std::map<DWORD, PageData>;
 
+	// Increases on every change of a page, including adding and removing it.
+	using PageVersion = uint64_t;
+
 	enum LineIndex {
 		kTopLine = 0,
 		kMiddleLine = 1,
@@ -25,4 +48,46 @@ namespace direct_output_proxy {
 		kX52Pro,
 		kFip,
 	};
+
+	// The number of DeviceType values, for arrays indexed by device type.
+	constexpr size_t kDeviceTypes = 3;
+
+	// The lanes of the SDK calls of a device. Queued calls of a higher lane run first.
+	enum class WriteLane {
+		// Feedback the user waits for, e.g. the echo of a button press.
+		kInteractive,
+		kNormal,
+		// High rate updates, e.g. gauges over UDP.
+		kBulk,
+	};
+
+	enum class StateChange {
+		kDeviceAdded,
+		kDeviceRemoved,
+		// Also sent when an existing page is renamed.
+		kPageAdded,
+		kPageRemoved,
+		kPageActivated,
+		kPageDeactivated,
+		kLine,
+	};
+
+	// Identifies an attached device, see DeviceHandle. Unlike the type it tells two devices of a type apart, and a
+	// device attached again gets a new one.
+	using DeviceId = uint64_t;
+
+	// A change of what a device shows. Changes carry the new value rather than a difference, so applying a change
+	// which a snapshot already has is harmless.
+	struct StateEvent {
+		DeviceType device = DeviceType::kUnknown;
+		DeviceId device_id = 0;
+		StateChange change = StateChange::kPageAdded;
+		DWORD page = 0;
+		// kLine only.
+		LineIndex line = kTopLine;
+		// The version of the page after the change, 0 for device and activation changes.
+		PageVersion version = 0;
+		// kPageAdded: the name of the page. kLine: the content of the line.
+		std::wstring text;
+	};
 }
@@ -5,9 +5,12 @@
 #include <iostream>
 #include <ios>
 #include "types.h"
+#include "DeviceTraits.h"
 #include <cstdlib>
 #include <optional>
 #include <sstream>
+#include <format>
+#include <string_view>
 
 namespace direct_output_proxy {
 	void ReportError(const std::wstring& message) {
@@ -18,6 +21,14 @@ namespace direct_output_proxy {
 		MessageBoxA(0, message.c_str(), "Error", MB_OK | MB_ICONERROR);
 	}
 
+	void ReportInfo(const std::string& message) {
+#ifdef _CONSOLE
+		std::cout << message << std::endl;
+#else
+		MessageBoxA(0, message.c_str(), "DirectOutputProxy", MB_OK | MB_ICONINFORMATION);
+#endif
+	}
+
 	std::string ResultToString(const HRESULT result) {
 		switch (result) {
 		case S_OK:
@@ -34,6 +45,12 @@ namespace direct_output_proxy {
 			return "Already exists";
 		case -ERROR_NOT_FOUND:
 			return "Not Found";
+		case -ERROR_REVISION_MISMATCH:
+			return "Version mismatch";
+		case -ERROR_TIMEOUT:
+			return "Device timed out";
+		case -ERROR_SERVICE_NOT_ACTIVE:
+			return "Device unavailable";
 		default:
 			std::stringstream ss;
 			ss << std::hex << result;
@@ -76,17 +93,47 @@ namespace direct_output_proxy {
 		return L"Unknown";
 	}
 
-	std::wstring ButtonToString(const DWORD button) {
-		switch (button) {
-		case SoftButton_Select:
-			return L"Select";
-		case SoftButton_Up:
-			return L"Up";
-		case SoftButton_Down:
-			return L"Down";
-		default:
-			return L"Button" + button;
+	std::string DevTypeToId(const DeviceType dev_type) {
+		switch (dev_type) {
+		case DeviceType::kX52Pro:
+			return "x52pro";
+		case DeviceType::kFip:
+			return "fip";
 		}
+		return "unknown";
+	}
+
+	std::optional<DeviceType> DevTypeFromId(const std::string& id) {
+		if (id == "x52pro") return DeviceType::kX52Pro;
+		if (id == "fip") return DeviceType::kFip;
+		return std::nullopt;
+	}
+
+	std::wstring ButtonToString(const DeviceType type, const DWORD button) {
+		const wchar_t* name = GetDeviceCaps(type).GetButtonName(button);
+		if (name == nullptr) return L"Button" + std::to_wstring(button);
+		return name;
+	}
+
+	std::optional<DWORD> StringToButton(const DeviceType type, const std::string& name) {
+		for (const ButtonInfo& button : GetDeviceCaps(type).buttons) {
+			if (WstrToStr(button.name) == name) return button.bit;
+		}
+		return std::nullopt;
+	}
+
+	std::optional<ResidencyPolicy> ResidencyPolicyFromString(const std::string& name) {
+		if (name == "lru") return ResidencyPolicy::kLru;
+		if (name == "priority") return ResidencyPolicy::kPriority;
+		if (name == "pinned") return ResidencyPolicy::kPinned;
+		return std::nullopt;
+	}
+
+	std::optional<WriteLane> WriteLaneFromString(const std::string& name) {
+		if (name == "interactive") return WriteLane::kInteractive;
+		if (name == "normal") return WriteLane::kNormal;
+		if (name == "bulk") return WriteLane::kBulk;
+		return std::nullopt;
 	}
 
 	std::optional<std::string> WstrToStr(const std::wstring& wstr) {
@@ -113,13 +160,40 @@ namespace direct_output_proxy {
 		case -ERROR_NOT_FOUND:
 			return 404;
 		case -ERROR_ALREADY_EXISTS:
+		case -ERROR_REVISION_MISMATCH:
 			return 409;
 		case E_INVALIDARG:
 			return 400;
 		case E_OUTOFMEMORY:
 			return 413;
+		case -ERROR_BUSY:
+			return 429;
+		case -ERROR_TIMEOUT:
+		case -ERROR_SERVICE_NOT_ACTIVE:
+			return 503;
 		default:
 			return 500;
 		}
 	}
+
+	void AppendJsonString(std::string& out, std::string_view value) {
+		out += '"';
+		for (const char c : value) {
+			switch (c) {
+			case '"':
+				out += "\\\"";
+				break;
+			case '\\':
+				out += "\\\\";
+				break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20) {
+					out += std::format("\\u{:04x}", static_cast<int>(c));
+				} else {
+					out += c;
+				}
+			}
+		}
+		out += '"';
+	}
 }